@@ -0,0 +1,937 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of the block read by every benchmark operation */
+#define BENCH_IO_SIZE 4096
+
+/* Default size of the file of the sequential, random and append benchmarks */
+#define BENCH_FILE_SIZE (1024 * 1024)
+
+/* Largest number of results printed by one run */
+#define BENCH_RESULTS_MAX 64
+
+/* Seed of the random benchmarks, so that every run does the same operations */
+#define BENCH_SEED 0x9e3779b97f4a7c15ULL
+
+struct thread_arg {
+	int argc;
+	char **argv;
+};
+
+/* Latencies of the operations of a benchmark (in seconds), and their I/O */
+struct latency {
+	double *samples;
+	long count;
+	long capacity;
+	size_t block_reads;
+	size_t block_writes;
+};
+
+/* Throughput and latency percentiles of a benchmark */
+struct bench_result {
+	char name[32];
+	long ops;
+	size_t bytes;
+	double elapsed;
+	double p50;
+	double p99;
+	double p999;
+	size_t block_reads;
+	size_t block_writes;
+};
+
+static struct bench_result results[BENCH_RESULTS_MAX];
+static int result_count;
+
+/* Print the results as JSON instead of text (--json) */
+static int json;
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void latency_add(struct latency *l, double seconds)
+{
+	if (l->count == l->capacity) {
+		l->capacity = l->capacity ? 2 * l->capacity : 1024;
+		l->samples = realloc(l->samples,
+				     l->capacity * sizeof(double));
+		if (!l->samples)
+			die("Cannot allocate latency samples");
+	}
+	l->samples[l->count++] = seconds;
+}
+
+/* Move the samples of @from to @to */
+void latency_merge(struct latency *to, struct latency *from)
+{
+	long i;
+
+	for (i = 0; i < from->count; i++)
+		latency_add(to, from->samples[i]);
+	free(from->samples);
+	memset(from, 0, sizeof(*from));
+}
+
+/* Block I/O counters at the start of the phase being measured */
+static struct fs_iostat phase_io;
+
+/* Start measuring the block I/O of a phase, return the current time */
+double phase_start(void)
+{
+	fs_iostat(&phase_io);
+	return now();
+}
+
+/* Account the block I/O done since phase_start() to @l */
+void phase_end(struct latency *l)
+{
+	struct fs_iostat io;
+
+	fs_iostat(&io);
+	l->block_reads += io.block_reads - phase_io.block_reads;
+	l->block_writes += io.block_writes - phase_io.block_writes;
+}
+
+int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Sample below which fraction @p of the (sorted) samples fall */
+double percentile(struct latency *l, double p)
+{
+	long i = p * l->count;
+
+	if (!l->count)
+		return 0;
+	return l->samples[i < l->count ? i : l->count - 1];
+}
+
+/*
+ * Record the result of benchmark @name, whose operations took the latencies
+ * in @l and moved @bytes bytes in @elapsed seconds, and print it as text
+ * (results are printed as JSON at the end of the run with --json).
+ */
+void report(const char *name, struct latency *l, size_t bytes, double elapsed)
+{
+	struct bench_result *r;
+
+	if (result_count == BENCH_RESULTS_MAX)
+		die("too many results");
+
+	r = &results[result_count++];
+	qsort(l->samples, l->count, sizeof(double), compare_double);
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->ops = l->count;
+	r->bytes = bytes;
+	r->elapsed = elapsed;
+	r->p50 = percentile(l, 0.50);
+	r->p99 = percentile(l, 0.99);
+	r->p999 = percentile(l, 0.999);
+	r->block_reads = l->block_reads;
+	r->block_writes = l->block_writes;
+
+	free(l->samples);
+	memset(l, 0, sizeof(*l));
+
+	if (json)
+		return;
+	printf("%s: ops=%ld ops/s=%.0f MB/s=%.1f p50=%.1fus p99=%.1fus "
+	       "p999=%.1fus reads=%zu writes=%zu\n", r->name, r->ops,
+	       r->ops / r->elapsed, r->bytes / r->elapsed / 1e6, r->p50 * 1e6,
+	       r->p99 * 1e6, r->p999 * 1e6, r->block_reads, r->block_writes);
+}
+
+void print_json(void)
+{
+	int i;
+
+	printf("{\"benchmarks\": [");
+	for (i = 0; i < result_count; i++) {
+		struct bench_result *r = &results[i];
+
+		printf("%s\n  {\"name\": \"%s\", \"ops\": %ld, \"bytes\": %zu, "
+		       "\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+		       "\"mb_per_sec\": %.3f, \"p50_us\": %.3f, "
+		       "\"p99_us\": %.3f, \"p999_us\": %.3f, "
+		       "\"block_reads\": %zu, \"block_writes\": %zu}",
+		       i ? "," : "", r->name, r->ops, r->bytes, r->elapsed,
+		       r->ops / r->elapsed, r->bytes / r->elapsed / 1e6,
+		       r->p50 * 1e6, r->p99 * 1e6, r->p999 * 1e6,
+		       r->block_reads, r->block_writes);
+	}
+	printf("\n]}\n");
+}
+
+/* Small per-thread PRNG (xorshift64), so that threads share no state */
+uint64_t next_rand(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+struct mtread_worker {
+	pthread_t thread;
+	int fd;
+	size_t file_size;
+	long ops;
+	uint64_t seed;
+};
+
+void *mtread_worker(void *arg)
+{
+	struct mtread_worker *w = arg;
+	char buf[BENCH_IO_SIZE];
+	size_t blocks = w->file_size / BENCH_IO_SIZE;
+	long i;
+
+	for (i = 0; i < w->ops; i++) {
+		size_t offset = (next_rand(&w->seed) % blocks) * BENCH_IO_SIZE;
+
+		if (fs_pread(w->fd, buf, BENCH_IO_SIZE, offset) != BENCH_IO_SIZE)
+			die("short read at offset %zu", offset);
+	}
+
+	return NULL;
+}
+
+/*
+ * Random 4 KiB reads with 1, 2, 4... threads, either each on its own file or
+ * all on one shared descriptor. Reads only take the read side of the file
+ * locks, so throughput should scale with the number of threads.
+ */
+void bench_mtread(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int max_threads, shared, nthreads, i;
+	size_t file_size = 64 * BENCH_IO_SIZE;
+	long ops = 20000;
+	char *buf;
+	double base = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [max threads] [ops per thread]");
+
+	diskname = t_arg->argv[0];
+	max_threads = t_arg->argc > 1 ? atoi(t_arg->argv[1]) : 8;
+	if (t_arg->argc > 2)
+		ops = atol(t_arg->argv[2]);
+	if (max_threads < 1)
+		die("invalid thread count");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* One file per thread, filled with a known pattern */
+	buf = malloc(file_size);
+	memset(buf, 'b', file_size);
+
+	int fds[max_threads];
+
+	for (i = 0; i < max_threads; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "mtread.%d", i);
+		fs_create(name);
+		fds[i] = fs_open(name);
+		if (fds[i] < 0) {
+			fs_umount();
+			die("Cannot open file %s", name);
+		}
+		if (fs_stat(fds[i]) < (int)file_size &&
+		    fs_write(fds[i], buf, file_size) != (int)file_size) {
+			fs_umount();
+			die("Not enough space on disk for %d files", max_threads);
+		}
+	}
+	free(buf);
+
+	for (shared = 0; shared <= 1; shared++) {
+		printf("mtread %s:\n", shared ? "one shared file" : "one file per thread");
+		for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+			struct mtread_worker workers[nthreads];
+			double start, elapsed, rate;
+
+			start = now();
+			for (i = 0; i < nthreads; i++) {
+				workers[i].fd = shared ? fds[0] : fds[i];
+				workers[i].file_size = file_size;
+				workers[i].ops = ops;
+				workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+				pthread_create(&workers[i].thread, NULL,
+					       mtread_worker, &workers[i]);
+			}
+			for (i = 0; i < nthreads; i++)
+				pthread_join(workers[i].thread, NULL);
+			elapsed = now() - start;
+
+			rate = nthreads * ops / elapsed;
+			if (nthreads == 1)
+				base = rate;
+			printf("threads=%d ops/s=%.0f speedup=%.2f\n",
+			       nthreads, rate, rate / base);
+		}
+	}
+
+	struct fs_poolstat buffers, files;
+
+	if (!fs_poolstat(&buffers, &files))
+		printf("pools: buffers high water=%zu allocated=%zu, "
+		       "files high water=%zu allocated=%zu\n",
+		       buffers.high_water, buffers.allocated,
+		       files.high_water, files.allocated);
+
+	for (i = 0; i < max_threads; i++)
+		fs_close(fds[i]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+struct fsync_worker {
+	pthread_t thread;
+	int fd;
+	long ops;
+	struct latency latency;
+};
+
+void *fsync_worker(void *arg)
+{
+	struct fsync_worker *w = arg;
+	char buf[BENCH_IO_SIZE];
+	long i;
+
+	memset(buf, 'f', sizeof(buf));
+
+	for (i = 0; i < w->ops; i++) {
+		double start = now();
+
+		if (fs_pwrite(w->fd, buf, BENCH_IO_SIZE,
+			      (i % 16) * BENCH_IO_SIZE) != BENCH_IO_SIZE)
+			die("short write");
+		if (fs_fsync(w->fd))
+			die("fsync failed");
+		latency_add(&w->latency, now() - start);
+	}
+
+	return NULL;
+}
+
+/*
+ * 4 KiB writes each followed by fs_fsync() with 1, 2, 4... threads, each on
+ * its own file. Concurrent fsyncs are committed together, so the latency of a
+ * write+fsync should stay flat while the throughput grows with the threads.
+ */
+void bench_fsync(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int max_threads, nthreads, i;
+	long ops = 200;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [max threads] [ops per thread]");
+
+	diskname = t_arg->argv[0];
+	max_threads = t_arg->argc > 1 ? atoi(t_arg->argv[1]) : 8;
+	if (t_arg->argc > 2)
+		ops = atol(t_arg->argv[2]);
+	if (max_threads < 1)
+		die("invalid thread count");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	int fds[max_threads];
+
+	for (i = 0; i < max_threads; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "fsync.%d", i);
+		fs_create(name);
+		fds[i] = fs_open(name);
+		if (fds[i] < 0) {
+			fs_umount();
+			die("Cannot open file %s", name);
+		}
+	}
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		struct fsync_worker workers[nthreads];
+		struct latency latency = { 0 };
+		double start, elapsed;
+		char name[32];
+
+		memset(workers, 0, sizeof(workers));
+		start = phase_start();
+		for (i = 0; i < nthreads; i++) {
+			workers[i].fd = fds[i];
+			workers[i].ops = ops;
+			pthread_create(&workers[i].thread, NULL,
+				       fsync_worker, &workers[i]);
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			latency_merge(&latency, &workers[i].latency);
+		}
+		elapsed = now() - start;
+		phase_end(&latency);
+
+		snprintf(name, sizeof(name), "fsync.threads=%d", nthreads);
+		report(name, &latency, (size_t)nthreads * ops * BENCH_IO_SIZE,
+		       elapsed);
+	}
+
+	for (i = 0; i < max_threads; i++)
+		fs_close(fds[i]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Numeric argument @i of the command, @def if absent */
+long arg_long(struct thread_arg *t_arg, int i, long def)
+{
+	long val;
+
+	if (t_arg->argc <= i)
+		return def;
+
+	val = strtol(t_arg->argv[i], NULL, 0);
+	if (val <= 0)
+		die("invalid argument '%s'", t_arg->argv[i]);
+	return val;
+}
+
+/* Create file @name, replacing any previous one, and open it */
+int bench_open(const char *name)
+{
+	int fd;
+
+	fs_delete(name);
+	if (fs_create(name) || (fd = fs_open(name)) < 0) {
+		fs_umount();
+		die("Cannot create file %s", name);
+	}
+
+	return fd;
+}
+
+void bench_close(int fd, const char *name)
+{
+	if (fs_close(fd) || fs_delete(name)) {
+		fs_umount();
+		die("Cannot remove file %s", name);
+	}
+}
+
+/*
+ * Write a file sequentially, @io size bytes at a time, then read it back the
+ * same way.
+ */
+void bench_seq(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct latency latency = { 0 };
+	size_t io_size, file_size, offset;
+	double start;
+	char *buf;
+	int fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [io size] [file size]");
+
+	io_size = arg_long(t_arg, 1, BENCH_IO_SIZE);
+	file_size = arg_long(t_arg, 2, BENCH_FILE_SIZE);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	buf = malloc(io_size);
+	memset(buf, 's', io_size);
+	fd = bench_open("bench.seq");
+
+	start = phase_start();
+	for (offset = 0; offset < file_size; offset += io_size) {
+		double t = now();
+
+		if (fs_write(fd, buf, io_size) != (int)io_size) {
+			fs_umount();
+			die("Not enough space on disk for %zu bytes", file_size);
+		}
+		latency_add(&latency, now() - t);
+	}
+	phase_end(&latency);
+	report("seqwrite", &latency, offset, now() - start);
+
+	fs_lseek(fd, 0);
+	start = phase_start();
+	for (offset = 0; offset < file_size; offset += io_size) {
+		double t = now();
+
+		if (fs_read(fd, buf, io_size) != (int)io_size)
+			die("short read at offset %zu", offset);
+		latency_add(&latency, now() - t);
+	}
+	phase_end(&latency);
+	report("seqread", &latency, offset, now() - start);
+
+	bench_close(fd, "bench.seq");
+	free(buf);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/*
+ * Write then read @ops blocks of @io size bytes at random aligned offsets of
+ * a file, once it has been filled.
+ */
+void bench_rand(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct latency latency = { 0 };
+	size_t io_size, file_size, blocks;
+	uint64_t seed = BENCH_SEED;
+	long ops, i;
+	double start;
+	char *buf;
+	int fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [io size] [file size] [ops]");
+
+	io_size = arg_long(t_arg, 1, BENCH_IO_SIZE);
+	file_size = arg_long(t_arg, 2, BENCH_FILE_SIZE);
+	blocks = file_size / io_size;
+	ops = arg_long(t_arg, 3, blocks);
+	if (!blocks)
+		die("file smaller than one io");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	buf = malloc(blocks * io_size);
+	memset(buf, 'r', blocks * io_size);
+	fd = bench_open("bench.rand");
+	if (fs_write(fd, buf, blocks * io_size) != (int)(blocks * io_size)) {
+		fs_umount();
+		die("Not enough space on disk for %zu bytes", file_size);
+	}
+
+	start = phase_start();
+	for (i = 0; i < ops; i++) {
+		size_t offset = (next_rand(&seed) % blocks) * io_size;
+		double t = now();
+
+		if (fs_pwrite(fd, buf, io_size, offset) != (int)io_size)
+			die("short write at offset %zu", offset);
+		latency_add(&latency, now() - t);
+	}
+	phase_end(&latency);
+	report("randwrite", &latency, ops * io_size, now() - start);
+
+	start = phase_start();
+	for (i = 0; i < ops; i++) {
+		size_t offset = (next_rand(&seed) % blocks) * io_size;
+		double t = now();
+
+		if (fs_pread(fd, buf, io_size, offset) != (int)io_size)
+			die("short read at offset %zu", offset);
+		latency_add(&latency, now() - t);
+	}
+	phase_end(&latency);
+	report("randread", &latency, ops * io_size, now() - start);
+
+	bench_close(fd, "bench.rand");
+	free(buf);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/*
+ * Create @count small files, stat them (open, stat, close) and delete them,
+ * @rounds times.
+ */
+void bench_files(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct latency create = { 0 }, stat = { 0 }, delete = { 0 };
+	double create_time = 0, stat_time = 0, delete_time = 0, start;
+	long count, rounds, r, i;
+	char name[FS_FILENAME_LEN];
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [files] [rounds]");
+
+	count = arg_long(t_arg, 1, 100);
+	rounds = arg_long(t_arg, 2, 10);
+	if (count > FS_FILE_MAX_COUNT)
+		die("at most %d files", FS_FILE_MAX_COUNT);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	for (r = 0; r < rounds; r++) {
+		start = phase_start();
+		for (i = 0; i < count; i++) {
+			double t = now();
+
+			snprintf(name, sizeof(name), "bench.f%ld", i);
+			if (fs_create(name)) {
+				fs_umount();
+				die("Cannot create file %s", name);
+			}
+			latency_add(&create, now() - t);
+		}
+		create_time += now() - start;
+		phase_end(&create);
+
+		start = phase_start();
+		for (i = 0; i < count; i++) {
+			double t = now();
+			int fd;
+
+			snprintf(name, sizeof(name), "bench.f%ld", i);
+			fd = fs_open(name);
+			if (fd < 0 || fs_stat(fd) < 0 || fs_close(fd))
+				die("Cannot stat file %s", name);
+			latency_add(&stat, now() - t);
+		}
+		stat_time += now() - start;
+		phase_end(&stat);
+
+		start = phase_start();
+		for (i = 0; i < count; i++) {
+			double t = now();
+
+			snprintf(name, sizeof(name), "bench.f%ld", i);
+			if (fs_delete(name))
+				die("Cannot delete file %s", name);
+			latency_add(&delete, now() - t);
+		}
+		delete_time += now() - start;
+		phase_end(&delete);
+	}
+
+	report("create", &create, 0, create_time);
+	report("stat", &stat, 0, stat_time);
+	report("delete", &delete, 0, delete_time);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Append @io size bytes at a time to a file opened with FS_OPEN_APPEND */
+void bench_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct latency latency = { 0 };
+	size_t io_size, file_size, offset;
+	double start;
+	char *buf;
+	int fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [io size] [file size]");
+
+	io_size = arg_long(t_arg, 1, 512);
+	file_size = arg_long(t_arg, 2, BENCH_FILE_SIZE);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	buf = malloc(io_size);
+	memset(buf, 'a', io_size);
+	fs_close(bench_open("bench.append"));
+	fd = fs_open_flags("bench.append", FS_OPEN_APPEND);
+	if (fd < 0) {
+		fs_umount();
+		die("Cannot open file bench.append");
+	}
+
+	start = phase_start();
+	for (offset = 0; offset < file_size; offset += io_size) {
+		double t = now();
+
+		if (fs_write(fd, buf, io_size) != (int)io_size) {
+			fs_umount();
+			die("Not enough space on disk for %zu bytes", file_size);
+		}
+		latency_add(&latency, now() - t);
+	}
+	phase_end(&latency);
+	report("append", &latency, offset, now() - start);
+
+	bench_close(fd, "bench.append");
+	free(buf);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Operations of the mixed workload, with their share out of 100 */
+enum { MIXED_READ, MIXED_WRITE, MIXED_APPEND, MIXED_META, MIXED_OPS };
+
+static const struct {
+	const char *name;
+	int share;
+} mixed_ops[MIXED_OPS] = {
+	{ "mixed.read", 50 },
+	{ "mixed.write", 25 },
+	{ "mixed.append", 15 },
+	{ "mixed.meta", 10 },
+};
+
+struct mixed_worker {
+	pthread_t thread;
+	int id;
+	int fd;
+	int append_fd;
+	long ops;
+	size_t blocks;
+	size_t bytes[MIXED_OPS];
+	struct latency latency[MIXED_OPS];
+};
+
+void *mixed_worker(void *arg)
+{
+	struct mixed_worker *w = arg;
+	uint64_t seed = BENCH_SEED * (w->id + 1);
+	char buf[BENCH_IO_SIZE], name[FS_FILENAME_LEN];
+	long i;
+
+	memset(buf, 'm', sizeof(buf));
+	snprintf(name, sizeof(name), "bench.t%d", w->id);
+
+	for (i = 0; i < w->ops; i++) {
+		size_t offset = (next_rand(&seed) % w->blocks) * BENCH_IO_SIZE;
+		int roll = next_rand(&seed) % 100, op, ret;
+		double t;
+
+		for (op = 0; roll >= mixed_ops[op].share; op++)
+			roll -= mixed_ops[op].share;
+
+		t = now();
+		switch (op) {
+		case MIXED_READ:
+			ret = fs_pread(w->fd, buf, BENCH_IO_SIZE, offset);
+			break;
+		case MIXED_WRITE:
+			ret = fs_pwrite(w->fd, buf, BENCH_IO_SIZE, offset);
+			break;
+		case MIXED_APPEND:
+			ret = fs_write(w->append_fd, buf, 256);
+			break;
+		default:
+			ret = fs_create(name) || fs_delete(name) ? -1 : 0;
+			break;
+		}
+		latency_add(&w->latency[op], now() - t);
+
+		if (ret < 0)
+			die("%s failed", mixed_ops[op].name);
+		w->bytes[op] += ret;
+	}
+
+	return NULL;
+}
+
+/*
+ * Random reads and writes of a per-thread file, appends to another and
+ * create/delete of a small file, mixed in fixed proportions, with @threads
+ * threads running concurrently.
+ */
+void bench_mixed(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	int nthreads, i, op;
+	long ops;
+	size_t file_size = 64 * BENCH_IO_SIZE;
+	double start, elapsed;
+	char *buf;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [threads] [ops per thread]");
+
+	nthreads = arg_long(t_arg, 1, 4);
+	ops = arg_long(t_arg, 2, 5000);
+	if (nthreads > FS_FILE_MAX_COUNT / 3)
+		die("at most %d threads", FS_FILE_MAX_COUNT / 3);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	struct mixed_worker workers[nthreads];
+
+	memset(workers, 0, sizeof(workers));
+	buf = malloc(file_size);
+	memset(buf, 'm', file_size);
+
+	for (i = 0; i < nthreads; i++) {
+		char name[32];
+
+		workers[i].id = i;
+		workers[i].ops = ops;
+		workers[i].blocks = file_size / BENCH_IO_SIZE;
+
+		snprintf(name, sizeof(name), "bench.m%d", i);
+		workers[i].fd = bench_open(name);
+		if (fs_write(workers[i].fd, buf, file_size) != (int)file_size) {
+			fs_umount();
+			die("Not enough space on disk for %d files", nthreads);
+		}
+
+		snprintf(name, sizeof(name), "bench.a%d", i);
+		fs_close(bench_open(name));
+		workers[i].append_fd = fs_open_flags(name, FS_OPEN_APPEND);
+	}
+	free(buf);
+
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].thread, NULL, mixed_worker,
+			       &workers[i]);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now() - start;
+
+	for (op = 0; op < MIXED_OPS; op++) {
+		struct latency latency = { 0 };
+		size_t bytes = 0;
+
+		for (i = 0; i < nthreads; i++) {
+			latency_merge(&latency, &workers[i].latency[op]);
+			bytes += workers[i].bytes[op];
+		}
+		report(mixed_ops[op].name, &latency, bytes, elapsed);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "bench.m%d", i);
+		bench_close(workers[i].fd, name);
+		snprintf(name, sizeof(name), "bench.a%d", i);
+		bench_close(workers[i].append_fd, name);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Every single-threaded workload, then the mixed one, with the default sizes */
+void bench_all(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg one;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	one.argc = 1;
+	one.argv = t_arg->argv;
+
+	bench_seq(&one);
+	bench_rand(&one);
+	bench_files(&one);
+	bench_append(&one);
+	bench_mixed(&one);
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} commands[] = {
+	{ "seq",	bench_seq },
+	{ "rand",	bench_rand },
+	{ "files",	bench_files },
+	{ "append",	bench_append },
+	{ "mixed",	bench_mixed },
+	{ "all",	bench_all },
+	{ "mtread",	bench_mtread },
+	{ "fsync",	bench_fsync }
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s [--json] <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program;
+	char *cmd;
+	struct thread_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	if (!strcmp(argv[0], "--json")) {
+		json = 1;
+		argc--;
+		argv++;
+		if (argc == 0)
+			usage(program);
+	}
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		fs_bench_error("invalid command '%s'", cmd);
+		usage(program);
+	}
+
+	if (json)
+		print_json();
+
+	return 0;
+}
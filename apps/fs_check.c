@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define fs_check_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_check_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+/*
+ * Exit status: 0 if the file system is consistent, or if every problem was
+ * repaired, 1 if problems are left, 2 if it cannot be checked.
+ */
+int main(int argc, char **argv)
+{
+	struct fs_check_report report;
+	int flags = 0;
+	int problems;
+
+	if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "repair")))
+		die("Usage: <diskname> [repair]");
+
+	if (argc == 3)
+		flags |= FS_CHECK_REPAIR;
+
+	problems = fs_check(argv[1], flags, &report);
+	if (problems < 0)
+		die("Cannot check virtual disk");
+
+	printf("geometry_errors=%zu\n", report.geometry_errors);
+	printf("leaked_blocks=%zu\n", report.leaked_blocks);
+	printf("cross_linked_blocks=%zu\n", report.cross_linked_blocks);
+	printf("refcount_errors=%zu\n", report.refcount_errors);
+	printf("cyclic_chains=%zu\n", report.cyclic_chains);
+	printf("broken_chains=%zu\n", report.broken_chains);
+	printf("size_mismatches=%zu\n", report.size_mismatches);
+	if (flags & FS_CHECK_REPAIR)
+		printf("repaired=%zu/%d\n", report.repaired, problems);
+
+	return (size_t)problems > report.repaired;
+}
@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Parse a non-negative number (decimal, or hexadecimal with 0x), -1 if invalid */
+long parse_count(const char *str)
+{
+	char *end;
+	long val = strtol(str, &end, 0);
+
+	if (*str == '\0' || *end != '\0' || val < 0)
+		return -1;
+
+	return val;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_options options = { 0 };
+	long data_blocks, features;
+
+	if (argc < 3 || argc > 4)
+		die("Usage: <diskname> <data block count> [features]");
+
+	data_blocks = parse_count(argv[2]);
+	if (data_blocks < 1 || data_blocks > FS_DATA_BLOCK_MAX)
+		die("data block count invalid, range is [1, %d]",
+		    FS_DATA_BLOCK_MAX);
+
+	if (argc > 3) {
+		features = parse_count(argv[3]);
+		if (features < 0 || (features & ~FS_FEATURE_ALL))
+			die("features invalid, mask is %#x", FS_FEATURE_ALL);
+		options.features = features;
+	}
+
+	if (fs_format(argv[1], data_blocks, &options))
+		die("Cannot create virtual disk");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n",
+	       argv[1], (size_t)data_blocks);
+
+	return 0;
+}
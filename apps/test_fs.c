@@ -1,12 +1,21 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -28,26 +37,246 @@ do {							\
 	exit(1);					\
 } while (0)
 
+/* Default number of threads of the bulk import and export commands */
+#define BULK_THREADS 4
+
+/* Maximum number of threads of the bulk import and export commands */
+#define BULK_THREADS_MAX 64
+
+/* Host files mapped ahead of the file system writes by the bulk import */
+#define BULK_WINDOW 64
+
+/* Files created by a single fs_create_many() call of the bulk import */
+#define BULK_BATCH 32
 
 struct thread_arg {
 	int argc;
 	char **argv;
 };
 
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fields of a script line: the command and up to three arguments */
+#define SCRIPT_ARGS 4
+
+/* Seed of the script PRNG until a SEED command changes it */
+#define SCRIPT_SEED 0x9e3779b97f4a7c15ULL
+
+/* Script line, split at tabs */
+struct script_line {
+	char *text;
+	char *args[SCRIPT_ARGS];
+	/* Line of the END closing a REPEAT or TIME, or of the command it closes */
+	int match;
+};
+
+/* REPEAT or TIME block being executed */
+struct script_block {
+	int line;
+	long remaining;
+	double start;
+	long ops;
+};
+
+/* File opened by the script, designated by its handle name */
+struct script_handle {
+	char *name;
+	int fd;
+};
+
+static int script_quiet;
+
+/* Print the outcome of a successful command, unless QUIET is on */
+void script_print(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (script_quiet)
+		return;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+/* Small PRNG (xorshift64) of the random offsets and sizes */
+uint64_t script_rand(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Numeric argument of a command, which must be present and at least @min */
+long script_number(const char *arg, long min)
+{
+	char *end;
+	long val;
+
+	if (!arg)
+		die("missing numeric argument");
+
+	val = strtol(arg, &end, 0);
+	if (*arg == '\0' || *end != '\0' || val < min)
+		die("invalid numeric argument '%s'", arg);
+
+	return val;
+}
+
+/* Content of host file @filename, to be freed by the caller */
+char *script_file_load(const char *filename, int *size)
+{
+	struct stat st;
+	char *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	data = malloc(st.st_size + 1);
+	if (!data)
+		die_perror("malloc");
+	if (read(fd, data, st.st_size) != st.st_size)
+		die_perror("read");
+	close(fd);
+
+	*size = st.st_size;
+	return data;
+}
+
+/* Split the @size bytes of @data into @count buffers of about the same size */
+struct iovec *script_iov_split(char *data, int size, int count)
+{
+	struct iovec *iov;
+	int i;
+
+	iov = malloc(count * sizeof(*iov));
+	if (!iov)
+		die_perror("malloc");
+
+	for (i = 0; i < count; i++) {
+		size_t start = (size_t)size * i / count;
+
+		iov[i].iov_base = data + start;
+		iov[i].iov_len = (size_t)size * (i + 1) / count - start;
+	}
+
+	return iov;
+}
+
+/*
+ * Read the lines of @script, of any length, split them, and pair every REPEAT
+ * and TIME with its END.
+ */
+struct script_line *script_load(const char *script, int *count)
+{
+	struct script_line *lines = NULL;
+	char *buf = NULL;
+	size_t size = 0;
+	int n = 0, depth = 0, i, j;
+	int *open;
+	FILE *fd_script;
+
+	/* Open script on host computer */
+	fd_script = fopen(script, "r");
+	if (!fd_script)
+		die_perror("fopen");
+
+	while (getline(&buf, &size, fd_script) != -1) {
+		struct script_line *line;
+
+		/* Remove trailing newline from command line */
+		char *nl = strchr(buf, '\n');
+		if (nl)
+			*nl = '\0';
+
+		lines = realloc(lines, (n + 1) * sizeof(*lines));
+		if (!lines)
+			die_perror("realloc");
+		line = &lines[n++];
+		memset(line, 0, sizeof(*line));
+
+		/* Tokenize line */
+		line->text = strdup(buf);
+		if (!line->text)
+			die_perror("strdup");
+		line->args[0] = strtok(line->text, "\t");
+		for (j = 1; j < SCRIPT_ARGS && line->args[j - 1]; j++)
+			line->args[j] = strtok(NULL, "\t");
+	}
+	free(buf);
+	fclose(fd_script);
+
+	open = malloc((n + 1) * sizeof(int));
+	if (!open)
+		die_perror("malloc");
+
+	for (i = 0; i < n; i++) {
+		char *command = lines[i].args[0];
+
+		if (!command)
+			continue;
+
+		if (!strcmp(command, "REPEAT") || !strcmp(command, "TIME")) {
+			open[depth++] = i;
+		} else if (!strcmp(command, "END")) {
+			if (!depth)
+				die("line %d: END without REPEAT or TIME", i + 1);
+			lines[i].match = open[--depth];
+			lines[lines[i].match].match = i;
+		}
+	}
+	if (depth)
+		die("line %d: %s without END", open[depth - 1] + 1,
+		    lines[open[depth - 1]].args[0]);
+
+	free(open);
+	*count = n;
+	return lines;
+}
+
+/* Index of the script handle named @name, -1 if there is none */
+int script_handle_find(struct script_handle *handles, int count,
+		       const char *name)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (!strcmp(handles[i].name, name))
+			return i;
+
+	return -1;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	struct stat st;
 	char *diskname, *script;
-	FILE *fd_script;
 	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
+	char **command_args;
 	int offset;
 	char mounted = 0;
 
-	char line_buffer[1024];
-	int command_index = 1;
+	struct script_line *lines;
+	struct script_block *blocks;
+	struct script_handle *handles = NULL;
+	int line_count, pc, depth = 0;
+	int handle_count = 0, handle_max = 0, current = -1;
+	uint64_t seed = SCRIPT_SEED;
+	long ops = 0;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <script filename>");
@@ -55,26 +284,16 @@ void thread_fs_script(void *arg)
 	diskname = t_arg->argv[0];
 	script = t_arg->argv[1];
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
-		die_perror("fopen");
-
-	int fs_fd = -1;
+	lines = script_load(script, &line_count);
+	blocks = malloc((line_count + 1) * sizeof(*blocks));
+	if (!blocks)
+		die_perror("malloc");
 
 	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
-		/* Remove trailing newline from command line */
-		char *nl = strchr(line_buffer, '\n');
-		if (nl)
-			*nl = '\0';
+	for (pc = 0; pc < line_count; pc++) {
+		int fs_fd = current < 0 ? -1 : handles[current].fd;
 
-		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
+		command_args = lines[pc].args;
 		command = command_args[0];
 
 		int data_fd;
@@ -86,19 +305,130 @@ void thread_fs_script(void *arg)
 		if (!command)
 			break;
 
-		if (strcmp(command, "MOUNT") == 0) {
+		if (strcmp(command, "REPEAT") == 0) {
+			long repeat = script_number(command_args[1], 0);
+
+			/* Skip the block altogether */
+			if (repeat == 0) {
+				pc = lines[pc].match;
+				continue;
+			}
+
+			blocks[depth++] = (struct script_block){
+				.line = pc,
+				.remaining = repeat,
+			};
+			continue;
+
+		} else if (strcmp(command, "TIME") == 0) {
+			blocks[depth++] = (struct script_block){
+				.line = pc,
+				.start = now(),
+				.ops = ops,
+			};
+			continue;
+
+		} else if (strcmp(command, "END") == 0) {
+			struct script_block *block = &blocks[depth - 1];
+			struct script_line *open = &lines[block->line];
+
+			if (strcmp(open->args[0], "REPEAT") == 0) {
+				/* Back to the first command of the block */
+				if (--block->remaining > 0) {
+					pc = block->line;
+					continue;
+				}
+			} else {
+				double elapsed = now() - block->start;
+				long block_ops = ops - block->ops;
+
+				printf("TIME %s: %ld ops in %.6f s (%.0f ops/s)\n",
+				       open->args[1] ? open->args[1] : "",
+				       block_ops, elapsed,
+				       elapsed > 0 ? block_ops / elapsed : 0);
+			}
+			depth--;
+			continue;
+
+		} else if (strcmp(command, "SEED") == 0) {
+			seed = script_number(command_args[1], 0);
+			/* Zero is a fixed point of the PRNG */
+			if (!seed)
+				seed = SCRIPT_SEED;
+			continue;
+
+		} else if (strcmp(command, "QUIET") == 0) {
+			script_quiet = command_args[1] &&
+				strcmp(command_args[1], "OFF") != 0;
+			continue;
+
+		} else if (strcmp(command, "USE") == 0) {
+			if (!command_args[1])
+				die("missing handle");
+
+			current = script_handle_find(handles, handle_count,
+						     command_args[1]);
+			if (current < 0) {
+				fs_umount();
+				die("No open file with handle %s", command_args[1]);
+			}
+			continue;
+
+		} else if (strcmp(command, "MOUNT") == 0 && command_args[1] &&
+			   strcmp(command_args[1], "SNAPSHOT") == 0) {
+			if (fs_snapshot_mount(diskname,
+					      script_number(command_args[2], 0)))
+				die("Cannot mount snapshot");
+			else {
+				script_print("MOUNT successful.\n");
+				mounted = 1;
+			}
+
+		} else if (strcmp(command, "MOUNT") == 0) {
 			if (fs_mount(diskname))
 				die("Cannot mount disk");
 			else {
-				printf("MOUNT successful.\n");
+				script_print("MOUNT successful.\n");
 				mounted = 1;
 			}
 
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Leave without unmounting, as if the machine went down */
+			script_print("CRASH\n");
+			fflush(stdout);
+			_exit(0);
+
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			script_print("SYNC successful.\n");
+
+		} else if (strcmp(command, "FEATURES") == 0) {
+			if (fs_set_features(script_number(command_args[1], 0))) {
+				fs_umount();
+				die("Cannot set features");
+			}
+
+			script_print("FEATURES successful.\n");
+
+		} else if (strcmp(command, "SNAPSHOT") == 0) {
+			int id = fs_snapshot_create();
+
+			if (id < 0) {
+				fs_umount();
+				die("Cannot create snapshot");
+			}
+
+			script_print("SNAPSHOT %d created.\n", id);
+
 		} else if (strcmp(command, "UMOUNT") == 0) {
 			if (mounted && fs_umount())
 				die("Cannot unmount");
 			else {
-				printf("UMOUNT successful.\n");
+				script_print("UMOUNT successful.\n");
 				mounted = 0;
 			}
 
@@ -110,7 +440,7 @@ void thread_fs_script(void *arg)
 				die("Cannot create file");
 			}
 
-			printf("CREATE successful.\n");
+			script_print("CREATE successful.\n");
 
 		} else if (strcmp(command, "DELETE") == 0) {
 			fs_filename = command_args[1];
@@ -120,11 +450,29 @@ void thread_fs_script(void *arg)
 				die("Cannot delete file");
 			}
 
-			printf("DELETE successful.\n");
+			script_print("DELETE successful.\n");
+
+		} else if (strcmp(command, "COPY") == 0) {
+			if (!command_args[1] || !command_args[2] ||
+			    fs_copy(command_args[1], command_args[2])) {
+				fs_umount();
+				die("Cannot copy file");
+			}
+
+			script_print("COPY successful.\n");
 
 		} else if (strcmp(command, "OPEN") == 0) {
+			/* The handle is named after the file unless specified */
+			char *handle = command_args[2] ? command_args[2] : command_args[1];
+
 			fs_filename = command_args[1];
 
+			if (!fs_filename ||
+			    script_handle_find(handles, handle_count, handle) >= 0) {
+				fs_umount();
+				die("Handle already open");
+			}
+
 			fs_fd = fs_open(fs_filename);
 
 			if (fs_fd < 0) {
@@ -132,33 +480,79 @@ void thread_fs_script(void *arg)
 				die("Cannot open file");
 			}
 
-			printf("OPEN successful.\n");
+			/* Grow the handles along with the open file table */
+			if (handle_count == handle_max) {
+				struct script_handle *grown;
+
+				handle_max = handle_max ? 2 * handle_max :
+					FS_OPEN_MAX_COUNT;
+				grown = realloc(handles, handle_max * sizeof(*handles));
+				if (!grown) {
+					fs_umount();
+					die_perror("realloc");
+				}
+				handles = grown;
+			}
+
+			current = handle_count++;
+			handles[current].name = handle;
+			handles[current].fd = fs_fd;
+
+			script_print("OPEN successful.\n");
 
 		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
+			int closed = current;
+
+			if (command_args[1])
+				closed = script_handle_find(handles, handle_count,
+							    command_args[1]);
+
+			if (closed < 0 || fs_close(handles[closed].fd)) {
 				fs_umount();
 				die("Cannot close file");
 			}
 
-			printf("CLOSE successful.\n");
+			/* Fill the hole with the last handle */
+			handles[closed] = handles[--handle_count];
+			if (current == closed)
+				current = -1;
+			else if (current == handle_count)
+				current = closed;
+
+			script_print("CLOSE successful.\n");
 
 		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+			if (command_args[1] && strcmp(command_args[1], "RANDOM") == 0)
+				offset = script_rand(&seed) %
+					script_number(command_args[2], 1);
+			else
+				offset = atoi(command_args[1]);
 
 			if (fs_lseek(fs_fd, offset)) {
 				fs_umount();
 				die("Cannot seek to position");
 			} else {
-				printf("SEEK successful.\n");
+				script_print("SEEK successful.\n");
 			}
 
 		} else if (strcmp(command, "WRITE") == 0) {
+			char file_mapped = 0, data_allocated = 0;
+
 			data_source = command_args[1];
 			data_description = command_args[2];
 
 			if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
+			} else if (strcmp(data_source, "RANDOM") == 0) {
+				data_size = 1 + script_rand(&seed) %
+					script_number(data_description, 1);
+				data = malloc(data_size);
+				if (data) {
+					for (count = 0; count < data_size; count++)
+						data[count] = script_rand(&seed);
+					data_allocated = 1;
+				}
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
@@ -174,7 +568,15 @@ void thread_fs_script(void *arg)
 					die("Not a regular file: %s\n", data_description);
 				}
 				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+				if (data_size > 0) {
+					data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+					file_mapped = data != MAP_FAILED;
+					if (!file_mapped)
+						data = NULL;
+				} else {
+					data = "";
+				}
+				close(data_fd);
 			} else {
 				data = NULL;
 				data_size = 0;
@@ -190,7 +592,150 @@ void thread_fs_script(void *arg)
 				fs_umount();
 				die("write error");
 			}
-			printf("Wrote %d bytes to file.\n", count);
+			script_print("Wrote %d bytes to file.\n", count);
+
+			if (file_mapped)
+				munmap(data, data_size);
+			if (data_allocated)
+				free(data);
+
+		} else if (strcmp(command, "WRITEV") == 0 ||
+			   strcmp(command, "READV") == 0) {
+			int buffers = script_number(command_args[1], 1);
+			struct iovec *iov;
+
+			if (!command_args[2] || strcmp(command_args[2], "FILE") ||
+			    !command_args[3]) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			data = script_file_load(command_args[3], &data_size);
+
+			if (strcmp(command, "WRITEV") == 0) {
+				iov = script_iov_split(data, data_size, buffers);
+				count = fs_writev(fs_fd, iov, buffers);
+				if (count < 0) {
+					fs_umount();
+					die("write error");
+				}
+				script_print("Wrote %d bytes to file.\n", count);
+			} else {
+				read_buf = calloc(data_size + 1, sizeof(char));
+				if (!read_buf)
+					die_perror("calloc");
+
+				iov = script_iov_split(read_buf, data_size, buffers);
+				count = fs_readv(fs_fd, iov, buffers);
+				if (count < 0) {
+					fs_umount();
+					die("read error");
+				}
+
+				if (count == data_size &&
+				    memcmp(data, read_buf, data_size) == 0)
+					script_print("Read %d bytes from file. Compared %d correct.\n",
+						     count, data_size);
+				else
+					printf("Read unexpected data! (%d bytes)\n", count);
+
+				free(read_buf);
+			}
+
+			free(iov);
+			free(data);
+
+		} else if (strcmp(command, "WRITEASYNC") == 0 ||
+			   strcmp(command, "READASYNC") == 0) {
+			int requests = script_number(command_args[1], 1);
+			int writing = strcmp(command, "WRITEASYNC") == 0;
+			struct fs_completion event;
+			struct iovec *iov;
+			char *buf;
+			int i, failed = 0;
+
+			if (!command_args[2] || strcmp(command_args[2], "FILE") ||
+			    !command_args[3]) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			data = script_file_load(command_args[3], &data_size);
+			read_buf = writing ? NULL : calloc(data_size + 1, sizeof(char));
+			if (!writing && !read_buf)
+				die_perror("calloc");
+
+			/* Submit every part at once, from the start of the file */
+			buf = writing ? data : read_buf;
+			iov = script_iov_split(buf, data_size, requests);
+			for (i = 0; i < requests; i++) {
+				char *part = iov[i].iov_base;
+				int ret = writing ?
+					fs_write_async(fs_fd, part, iov[i].iov_len,
+						       part - buf, &iov[i]) :
+					fs_read_async(fs_fd, part, iov[i].iov_len,
+						      part - buf, &iov[i]);
+
+				if (ret)
+					die("Cannot submit request");
+			}
+
+			/* The requests complete in any order */
+			for (count = 0, i = 0; i < requests; i++) {
+				struct iovec *done;
+
+				if (fs_async_wait(&event, 1) != 1)
+					die("Cannot wait for request");
+
+				done = event.tag;
+				if (event.result != (int)done->iov_len)
+					failed = 1;
+				else
+					count += event.result;
+			}
+
+			if (writing) {
+				if (failed) {
+					fs_umount();
+					die("write error");
+				}
+				script_print("Wrote %d bytes to file.\n", count);
+			} else {
+				if (failed) {
+					fs_umount();
+					die("read error");
+				}
+
+				if (count == data_size &&
+				    memcmp(data, read_buf, data_size) == 0)
+					script_print("Read %d bytes from file. Compared %d correct.\n",
+						     count, data_size);
+				else
+					printf("Read unexpected data! (%d bytes)\n", count);
+
+				free(read_buf);
+			}
+
+			free(iov);
+			free(data);
+
+		} else if (strcmp(command, "READ") == 0 && command_args[1] &&
+			   strcmp(command_args[1], "RANDOM") == 0) {
+			int read_req_length = 1 + script_rand(&seed) %
+				script_number(command_args[2], 1);
+
+			read_buf = malloc(read_req_length);
+			if (!read_buf)
+				die_perror("malloc");
+
+			count = fs_read(fs_fd, read_buf, read_req_length);
+			if (count < 0) {
+				fs_umount();
+				die("read error");
+			}
+			script_print("Read %d bytes from file.\n", count);
+
+			free(read_buf);
 
 		} else if (strcmp(command, "READ") == 0) {
 			int read_req_length = atoi(command_args[1]);
@@ -216,6 +761,7 @@ void thread_fs_script(void *arg)
 					fs_umount();
 					die("Not a regular file: %s\n", data_description);
 				}
+				close(data_fd);
 
 				FILE *data_file = fopen(data_description, "r");
 				data_size = st.st_size;
@@ -250,7 +796,7 @@ void thread_fs_script(void *arg)
 			// both data and read_buf were allocated with an extra zero byte
 			// +1 here to check for the canaries
 			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
+				script_print("Read %d bytes from file. Compared %d correct.\n", count, data_size);
 			else
 				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
 
@@ -259,6 +805,9 @@ void thread_fs_script(void *arg)
 				free(data);
 			}
 		}
+
+		/* Operations counted by the enclosing TIME blocks */
+		ops++;
 	}
 
 	/* unmount at the end just to be safe in case there is
@@ -266,7 +815,11 @@ void thread_fs_script(void *arg)
 	if (mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	for (pc = 0; pc < line_count; pc++)
+		free(lines[pc].text);
+	free(lines);
+	free(blocks);
+	free(handles);
 }
 
 void thread_fs_stat(void *arg)
@@ -319,7 +872,7 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
 	int stat, read;
 
@@ -348,14 +901,62 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+
+	/* The content is streamed straight to stdout, behind the header */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+
+	read = fs_sendfile(fs_fd, STDOUT_FILENO, 0, stat);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (read != stat)
+		die("Short read of file '%s' (%d/%d bytes)", filename, read,
+		    stat);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *host_filename;
+	int fd, fs_fd;
+	int stat, exported;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	host_filename = t_arg->argv[2];
+
+	/* Create file on host computer */
+	fd = open(host_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot stat file");
 	}
 
-	read = fs_read(fs_fd, buf, stat);
+	exported = stat ? fs_sendfile(fs_fd, fd, 0, stat) : 0;
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -363,14 +964,13 @@ void thread_fs_cat(void *arg)
 	}
 
 	if (fs_umount())
-		die("cannot unmount diskname");
+		die("Cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
+	if (close(fd))
+		die_perror("close");
 
-	free(buf);
+	printf("Exported file '%s' to '%s' (%d/%d bytes)\n", filename,
+	       host_filename, exported, stat);
 }
 
 void thread_fs_rm(void *arg)
@@ -461,6 +1061,383 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/* Host file of a bulk import, named on the file system after its relative path */
+struct bulk_file {
+	char name[FS_FILENAME_LEN];
+	char *path;
+	char *data;
+	size_t size;
+	/* Set once the file is mapped (or failed to), under bulk.lock */
+	int ready;
+	int error;
+};
+
+/* State shared by the threads of a bulk import or export */
+static struct {
+	const char *root;
+	struct bulk_file *files;
+	size_t count;
+	size_t capacity;
+	/* Next file to map or export */
+	size_t next;
+	/* Files already written to the file system by the import */
+	size_t done;
+	/* Files and bytes exported */
+	size_t exported;
+	size_t bytes;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} bulk = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* nftw() callback collecting the regular files of the imported tree */
+int bulk_collect(const char *path, const struct stat *st, int type,
+		 struct FTW *ftw)
+{
+	const char *name = path + strlen(bulk.root);
+	struct bulk_file *file;
+
+	(void)st;
+	(void)ftw;
+
+	if (type != FTW_F)
+		return 0;
+
+	while (*name == '/')
+		name++;
+	if (strlen(name) > FS_FILENAME_LEN - 1) {
+		test_fs_error("Skipping '%s': name too long", name);
+		return 0;
+	}
+
+	if (bulk.count == bulk.capacity) {
+		bulk.capacity = bulk.capacity ? 2 * bulk.capacity : 64;
+		bulk.files = realloc(bulk.files,
+				     bulk.capacity * sizeof(struct bulk_file));
+		if (!bulk.files)
+			die_perror("realloc");
+	}
+
+	file = &bulk.files[bulk.count++];
+	memset(file, 0, sizeof(*file));
+	strcpy(file->name, name);
+	file->path = strdup(path);
+
+	return 0;
+}
+
+/* Map a host file to import, with the kernel reading it ahead */
+void bulk_map(struct bulk_file *file)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(file->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		file->error = 1;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	file->size = st.st_size;
+	if (file->size) {
+		file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+				  fd, 0);
+		if (file->data == MAP_FAILED) {
+			file->data = NULL;
+			file->error = 1;
+		} else {
+			madvise(file->data, file->size,
+				MADV_SEQUENTIAL | MADV_WILLNEED);
+		}
+	}
+	close(fd);
+}
+
+/* Map the host files in order, at most BULK_WINDOW ahead of the writes */
+void *bulk_import_reader(void *arg)
+{
+	size_t i;
+
+	(void)arg;
+
+	pthread_mutex_lock(&bulk.lock);
+	while (bulk.next < bulk.count) {
+		if (bulk.next >= bulk.done + BULK_WINDOW) {
+			pthread_cond_wait(&bulk.cond, &bulk.lock);
+			continue;
+		}
+		i = bulk.next++;
+		pthread_mutex_unlock(&bulk.lock);
+
+		bulk_map(&bulk.files[i]);
+
+		pthread_mutex_lock(&bulk.lock);
+		bulk.files[i].ready = 1;
+		pthread_cond_broadcast(&bulk.cond);
+	}
+	pthread_mutex_unlock(&bulk.lock);
+
+	return NULL;
+}
+
+/* Write a mapped host file to the file system file created for it */
+int bulk_import_file(struct bulk_file *file)
+{
+	int fs_fd, written = 0;
+
+	fs_fd = fs_open(file->name);
+	if (fs_fd < 0)
+		return -1;
+
+	if (file->size)
+		written = fs_write(fs_fd, file->data, file->size);
+
+	if (fs_close(fs_fd) || written != (int)file->size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Import every regular file of a host directory tree, named after its path
+ * relative to the directory. Reader threads map the files ahead, while this
+ * thread creates them in batches and writes each with a single fs_write().
+ */
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int threads, i;
+	size_t batch, j, imported = 0, bytes = 0;
+	double start, elapsed;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [threads]");
+
+	diskname = t_arg->argv[0];
+	bulk.root = t_arg->argv[1];
+	threads = t_arg->argc > 2 ? atoi(t_arg->argv[2]) : BULK_THREADS;
+	if (threads < 1 || threads > BULK_THREADS_MAX)
+		die("invalid thread count (1 to %d)", BULK_THREADS_MAX);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	start = now();
+
+	if (nftw(bulk.root, bulk_collect, 16, FTW_PHYS)) {
+		fs_umount();
+		die_perror("nftw");
+	}
+
+	pthread_t readers[threads];
+
+	/* Carry on with the readers that could be created, if any */
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&readers[i], NULL, bulk_import_reader, NULL))
+			break;
+	}
+	if (!i) {
+		fs_umount();
+		die("Cannot create threads");
+	}
+	threads = i;
+
+	for (batch = 0; batch < bulk.count; batch += BULK_BATCH) {
+		size_t n = bulk.count - batch < BULK_BATCH ?
+			   bulk.count - batch : BULK_BATCH;
+		const char *names[BULK_BATCH];
+		int results[BULK_BATCH];
+
+		for (j = 0; j < n; j++)
+			names[j] = bulk.files[batch + j].name;
+		fs_create_many(names, n, results);
+
+		for (j = 0; j < n; j++) {
+			struct bulk_file *file = &bulk.files[batch + j];
+
+			pthread_mutex_lock(&bulk.lock);
+			while (!file->ready)
+				pthread_cond_wait(&bulk.cond, &bulk.lock);
+			pthread_mutex_unlock(&bulk.lock);
+
+			if (results[j] || file->error || bulk_import_file(file)) {
+				test_fs_error("Cannot import '%s'", file->path);
+			} else {
+				imported++;
+				bytes += file->size;
+			}
+
+			if (file->data)
+				munmap(file->data, file->size);
+			free(file->path);
+
+			pthread_mutex_lock(&bulk.lock);
+			bulk.done++;
+			pthread_cond_broadcast(&bulk.cond);
+			pthread_mutex_unlock(&bulk.lock);
+		}
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_join(readers[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	elapsed = now() - start;
+
+	printf("Imported %zu/%zu files (%zu bytes) in %.3f s: %.0f files/s, "
+	       "%.1f MB/s\n", imported, bulk.count, bytes, elapsed,
+	       imported / elapsed, bytes / elapsed / 1e6);
+
+	free(bulk.files);
+}
+
+/* Create the missing parent directories of host path @path */
+void bulk_mkdirs(char *path)
+{
+	char *slash;
+
+	for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+		if (slash == path)
+			continue;
+		*slash = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			perror("mkdir");
+		*slash = '/';
+	}
+}
+
+/* Whether file name @name stays within the export directory once on the host */
+int bulk_name_safe(const char *name)
+{
+	const char *c = name;
+
+	if (name[0] == '/')
+		return 0;
+
+	/* Look for a ".." component */
+	while (1) {
+		if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || !c[2]))
+			return 0;
+		c = strchr(c, '/');
+		if (!c)
+			return 1;
+		c++;
+	}
+}
+
+/* Export files of the directory listing, one at a time, until none is left */
+void *bulk_export_worker(void *arg)
+{
+	struct fs_dirent *entries = arg;
+	char path[PATH_MAX];
+	size_t i;
+	int fd, fs_fd, sent;
+
+	while ((i = __atomic_fetch_add(&bulk.next, 1, __ATOMIC_RELAXED)) <
+	       bulk.count) {
+		if (!bulk_name_safe(entries[i].name)) {
+			test_fs_error("Skipping '%s': name escapes '%s'",
+				      entries[i].name, bulk.root);
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", bulk.root,
+			 entries[i].name);
+		bulk_mkdirs(path);
+
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("open");
+			continue;
+		}
+
+		fs_fd = fs_open(entries[i].name);
+		sent = fs_fd < 0 ? -1 : entries[i].size ?
+		       fs_sendfile(fs_fd, fd, 0, entries[i].size) : 0;
+		if (fs_fd >= 0)
+			fs_close(fs_fd);
+		close(fd);
+
+		if (sent != (int)entries[i].size) {
+			test_fs_error("Cannot export '%s'", entries[i].name);
+			continue;
+		}
+
+		__atomic_add_fetch(&bulk.exported, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&bulk.bytes, sent, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/*
+ * Export every file of the file system into a host directory, several files
+ * at a time, slashes in file names creating subdirectories.
+ */
+void thread_fs_dump(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+	char *diskname;
+	int threads, i, count;
+	double start, elapsed;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [threads]");
+
+	diskname = t_arg->argv[0];
+	bulk.root = t_arg->argv[1];
+	threads = t_arg->argc > 2 ? atoi(t_arg->argv[2]) : BULK_THREADS;
+	if (threads < 1 || threads > BULK_THREADS_MAX)
+		die("invalid thread count (1 to %d)", BULK_THREADS_MAX);
+
+	if (mkdir(bulk.root, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	start = now();
+
+	count = fs_readdir(entries, FS_FILE_MAX_COUNT);
+	if (count < 0) {
+		fs_umount();
+		die("Cannot list files");
+	}
+	bulk.count = count;
+
+	pthread_t workers[threads];
+
+	/* Carry on with the workers that could be created, if any */
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, bulk_export_worker, entries))
+			break;
+	}
+	if (!i) {
+		fs_umount();
+		die("Cannot create threads");
+	}
+	threads = i;
+	for (i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	elapsed = now() - start;
+
+	printf("Exported %zu/%zu files (%zu bytes) in %.3f s: %.0f files/s, "
+	       "%.1f MB/s\n", bulk.exported, bulk.count, bulk.bytes, elapsed,
+	       bulk.exported / elapsed, bulk.bytes / elapsed / 1e6);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -516,7 +1493,10 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "export",	thread_fs_export },
 	{ "stat",	thread_fs_stat },
+	{ "import",	thread_fs_import },
+	{ "dump",	thread_fs_dump },
 	{ "script",	thread_fs_script }
 };
 
@@ -244,6 +244,551 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+# export a multi-block file written by fs_ref.x back to the host
+export_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=9
+	run_tool ./fs_ref.x add test.fs test-file-1
+	run_test ./test_fs.x export test.fs test-file-1 test-file-2
+	local same=$(cmp -s test-file-1 test-file-2 && echo "identical")
+
+	rm -f test.fs test-file-1 test-file-2
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("${same}")
+	local corr_array=()
+	corr_array+=("Exported file 'test-file-1' to 'test-file-2' (9000/9000 bytes)")
+	corr_array+=("identical")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Optional features
+#
+
+# packed tails read back after a remount
+tailpack_remount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=1
+	run_tool dd if=/dev/urandom of=test-file-2 bs=1000 count=9
+    cat <<END_SCRIPT > tailpack_remount.script
+MOUNT
+FEATURES	1
+CREATE	test-file-1
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+CREATE	test-file-2
+OPEN	test-file-2
+WRITE	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs tailpack_remount.script
+    cat <<END_SCRIPT > tailpack_remount.script
+MOUNT
+OPEN	test-file-1
+READ	1000	FILE	test-file-1
+CLOSE
+OPEN	test-file-2
+READ	9000	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs tailpack_remount.script
+	local stdout="${STDOUT}"
+	# both tails share a block
+	run_test ./test_fs.x info test.fs
+	local free=$(echo "${STDOUT}" | grep fat_free_ratio)
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 test-file-2 tailpack_remount.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("$(select_line "${stdout}" "6")")
+	line_array+=("${free}")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 1000 bytes from file. Compared 1000 correct.")
+	corr_array+=("Read 9000 bytes from file. Compared 9000 correct.")
+	corr_array+=("fat_free_ratio=96/100")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# data written and read back with several buffers per call
+vectored_remount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=9
+    cat <<END_SCRIPT > vectored_remount.script
+MOUNT
+CREATE	test-file
+OPEN	test-file
+WRITEV	3	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs vectored_remount.script
+    cat <<END_SCRIPT > vectored_remount.script
+MOUNT
+OPEN	test-file
+READV	5	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs vectored_remount.script
+	local stdout="${STDOUT}"
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 vectored_remount.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 9000 bytes from file. Compared 9000 correct.")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# data written and read back with asynchronous requests
+async_remount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=9
+	run_tool dd if=/dev/urandom of=test-file-2 bs=1000 count=9
+    cat <<END_SCRIPT > async_remount.script
+MOUNT
+CREATE	test-file
+OPEN	test-file
+WRITE	FILE	test-file-1
+WRITEASYNC	4	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs async_remount.script
+    cat <<END_SCRIPT > async_remount.script
+MOUNT
+OPEN	test-file
+READASYNC	3	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs async_remount.script
+	local stdout="${STDOUT}"
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 test-file-2 async_remount.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 9000 bytes from file. Compared 9000 correct.")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# writing to a copy leaves the original alone
+reflink_remount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=9
+	run_tool dd if=/dev/urandom of=test-file-2 bs=1000 count=4
+	# the copy once its second half is overwritten
+	{ head -c 5000 test-file-1; cat test-file-2; } > test-file-3
+    cat <<END_SCRIPT > reflink_remount.script
+MOUNT
+CREATE	test-file
+OPEN	test-file
+WRITE	FILE	test-file-1
+CLOSE
+COPY	test-file	test-copy
+OPEN	test-copy
+SEEK	5000
+WRITE	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs reflink_remount.script
+    cat <<END_SCRIPT > reflink_remount.script
+MOUNT
+OPEN	test-file
+READ	9000	FILE	test-file-1
+CLOSE
+OPEN	test-copy
+READ	9000	FILE	test-file-3
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs reflink_remount.script
+	local stdout="${STDOUT}"
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 test-file-2 test-file-3 reflink_remount.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("$(select_line "${stdout}" "6")")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 9000 bytes from file. Compared 9000 correct.")
+	corr_array+=("Read 9000 bytes from file. Compared 9000 correct.")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a write past the end of file leaves a hole reading back as zeros
+sparse_remount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=3
+	{ head -c 100000 /dev/zero; cat test-file-1; } > test-file-2
+    cat <<END_SCRIPT > sparse_remount.script
+MOUNT
+CREATE	test-file
+OPEN	test-file
+SEEK	100000
+WRITE	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs sparse_remount.script
+    cat <<END_SCRIPT > sparse_remount.script
+MOUNT
+OPEN	test-file
+READ	103000	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs sparse_remount.script
+	local stdout="${STDOUT}"
+	# the hole takes no data block
+	run_test ./test_fs.x info test.fs
+	local free=$(echo "${STDOUT}" | grep fat_free_ratio)
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 test-file-2 sparse_remount.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("${free}")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 103000 bytes from file. Compared 103000 correct.")
+	corr_array+=("fat_free_ratio=96/100")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# data synced with the journal on survives a crash
+journal_crash() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=9
+	run_tool dd if=/dev/urandom of=test-file-2 bs=1000 count=9
+    cat <<END_SCRIPT > journal_crash.script
+MOUNT
+FEATURES	8
+UMOUNT
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+SYNC
+CREATE	test-file-2
+OPEN	test-file-2
+WRITE	FILE	test-file-2
+CRASH
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs journal_crash.script
+    cat <<END_SCRIPT > journal_crash.script
+MOUNT
+OPEN	test-file-1
+READ	9000	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs journal_crash.script
+	local stdout="${STDOUT}"
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 test-file-2 journal_crash.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 9000 bytes from file. Compared 9000 correct.")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a refused feature change leaves the file system mountable
+features_refused() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+    cat <<END_SCRIPT > features_refused.script
+MOUNT
+FEATURES	31
+SNAPSHOT
+FEATURES	7
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs features_refused.script
+    cat <<END_SCRIPT > features_refused.script
+MOUNT
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs features_refused.script
+	local stdout="${STDOUT}"
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs features_refused.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "1")")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("MOUNT successful.")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a snapshot taken with the journal on survives a crash
+snapshot_journal() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=3
+	run_tool dd if=/dev/urandom of=test-file-2 bs=1000 count=3
+    cat <<END_SCRIPT > snapshot_journal.script
+MOUNT
+FEATURES	26
+UMOUNT
+MOUNT
+CREATE	test-file
+OPEN	test-file
+WRITE	FILE	test-file-1
+CLOSE
+SNAPSHOT
+OPEN	test-file
+WRITE	FILE	test-file-2
+CLOSE
+SYNC
+CRASH
+END_SCRIPT
+    run_tool ./test_fs.x script test.fs snapshot_journal.script
+    cat <<END_SCRIPT > snapshot_journal.script
+MOUNT	SNAPSHOT	0
+OPEN	test-file
+READ	3000	FILE	test-file-1
+CLOSE
+UMOUNT
+MOUNT
+OPEN	test-file
+READ	3000	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs snapshot_journal.script
+	local stdout="${STDOUT}"
+	run_test ./fs_check.x test.fs
+
+	rm -f test.fs test-file-1 test-file-2 snapshot_journal.script
+
+	local line_array=()
+	line_array+=("$(select_line "${stdout}" "3")")
+	line_array+=("$(select_line "${stdout}" "8")")
+	line_array+=("${RET}")
+	local corr_array=()
+	corr_array+=("Read 3000 bytes from file. Compared 3000 correct.")
+	corr_array+=("Read 3000 bytes from file. Compared 3000 correct.")
+	corr_array+=("0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Phase 5: performance regressions
+#
+
+# Baseline of the workloads below, allowed growth of block I/O and allowed drop
+# of throughput ratios (in percent), and runs of each workload
+PERF_BASELINE=${PERF_BASELINE:-perf_baseline.txt}
+PERF_IO_TOLERANCE=${PERF_IO_TOLERANCE:-10}
+PERF_RATIO_TOLERANCE=${PERF_RATIO_TOLERANCE:-30}
+PERF_RUNS=${PERF_RUNS:-3}
+
+# Workloads, as <name>|<data blocks of the fresh image>|<fs_bench.x command>
+# (the image of 'full' is exactly filled by the benchmark file)
+PERF_WORKLOADS=(
+	"seq|8192|seq 4096 16777216"
+	"rand|8192|rand 4096 16777216"
+	"files|8192|files 100 10"
+	"append|8192|append 512 1048576"
+	"full|4096|seq 4096 16773120"
+	"fullrand|4096|rand 4096 16773120"
+)
+
+# Throughput ratios, as <result>:<reference result>. Both come from the same
+# run of the script, so that their ratio does not depend on the host.
+PERF_RATIOS=(
+	"full/seqwrite:seq/seqwrite"
+	"fullrand/randwrite:rand/randwrite"
+)
+
+perf_results() {
+	# 1: JSON output of fs_bench.x
+	# 2: workload name
+	python3 -c '
+import json, sys
+for r in json.loads(sys.argv[1])["benchmarks"]:
+    print("%s/%s %d %d %d" % (sys.argv[2], r["name"], r["ops_per_sec"],
+                              r["block_reads"], r["block_writes"]))
+' "${1}" "${2}"
+}
+
+# Run the workloads on fresh images, PERF_RUNS times each, and compare their
+# block I/O (which must not grow by more than PERF_IO_TOLERANCE%) and the
+# PERF_RATIOS of their best throughput (which must not drop by more than
+# PERF_RATIO_TOLERANCE%) to the baseline. Absolute throughput depends on the
+# host, so it is only reported. With PERF_UPDATE=1, the baseline is rewritten
+# with the results instead.
+perf_regression() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	local -A got
+	local -A best
+	local names=()
+	local workload name blocks cmd run
+	for workload in "${PERF_WORKLOADS[@]}"; do
+		IFS='|' read -r name blocks cmd <<< "${workload}"
+		for (( run = 0; run < PERF_RUNS; run++ )); do
+			run_tool ./fs_make.x perf.fs "${blocks}"
+			run_test ./fs_bench.x --json ${cmd/ / perf.fs }
+			rm -f perf.fs
+			[[ ${RET} -ne 0 ]] && warning "workload ${name} failed: ${STDERR}"
+			local result ops reads writes
+			while read -r result ops reads writes; do
+				[[ -z "${best[${result}]}" ]] && names+=("${result}")
+				[[ ${ops} -gt ${best[${result}]:-0} ]] && best[${result}]=${ops}
+				got[${result}]="${reads} ${writes}"
+			done < <(perf_results "${STDOUT}" "${name}")
+		done
+	done
+
+	for name in "${names[@]}"; do
+		inf "${name}: ${best[${name}]} ops/s"
+	done
+
+	# throughput of a result, in percent of its reference result
+	local -A ratio
+	local pair ref
+	for pair in "${PERF_RATIOS[@]}"; do
+		IFS=':' read -r name ref <<< "${pair}"
+		[[ ${best[${ref}]:-0} -gt 0 ]] &&
+			ratio[${pair}]=$(( best[${name}] * 100 / best[${ref}] ))
+		inf "${pair}: ${ratio[${pair}]:-?}%"
+	done
+
+	if [[ "${PERF_UPDATE}" == "1" ]]; then
+		{
+			echo "# Baseline of perf_regression() in test_fs_student.sh"
+			echo "# <workload>/<result> <block reads> <block writes>"
+			for name in "${names[@]}"; do
+				echo "${name} ${got[${name}]}"
+			done
+			echo "# <workload>/<result>:<workload>/<result> <ops/s ratio in percent>"
+			for pair in "${PERF_RATIOS[@]}"; do
+				echo "${pair} ${ratio[${pair}]}"
+			done
+		} > "${PERF_BASELINE}"
+		inf "Baseline ${PERF_BASELINE} updated"
+		return
+	fi
+	[[ -r "${PERF_BASELINE}" ]] || die "Can't find baseline ${PERF_BASELINE}"
+
+	local line_array=()
+	local corr_array=()
+	while read -r name reads writes; do
+		[[ -z "${name}" || "${name}" == \#* ]] && continue
+
+		# throughput ratio, <reads> holds it
+		if [[ "${name}" == *:* ]]; then
+			local min_ratio=$(( reads * (100 - PERF_RATIO_TOLERANCE) / 100 ))
+			local expect="${name} ratio>=${min_ratio}%"
+
+			if [[ -n "${ratio[${name}]}" && ${ratio[${name}]} -ge ${min_ratio} ]]; then
+				line_array+=("${expect}")
+			else
+				line_array+=("${name} ratio=${ratio[${name}]:-?}%")
+				PERF_REGRESSIONS=$(( PERF_REGRESSIONS + 1 ))
+			fi
+			corr_array+=("${expect}")
+			continue
+		fi
+
+		local max_reads=$(( reads + reads * PERF_IO_TOLERANCE / 100 ))
+		local max_writes=$(( writes + writes * PERF_IO_TOLERANCE / 100 ))
+		local expect="${name} reads<=${max_reads} writes<=${max_writes}"
+
+		local g_reads g_writes
+		read -r g_reads g_writes <<< "${got[${name}]}"
+		if [[ -n "${g_reads}" &&
+		      ${g_reads} -le ${max_reads} && ${g_writes} -le ${max_writes} ]]; then
+			line_array+=("${expect}")
+		else
+			line_array+=("${name} reads=${g_reads:-?} writes=${g_writes:-?}")
+			PERF_REGRESSIONS=$(( PERF_REGRESSIONS + 1 ))
+		fi
+		corr_array+=("${expect}")
+	done < "${PERF_BASELINE}"
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -255,14 +800,30 @@ run_tests() {
 	create_simple
     # Phase 3 + 4
 	read_block
+	export_file
+	# Optional features
+	tailpack_remount
+	vectored_remount
+	async_remount
+	reflink_remount
+	sparse_remount
+	journal_crash
+	features_refused
+	snapshot_journal
+	# Phase 5
+	perf_regression
 }
 
 make_fs() {
+    # The tests parse and generate data with python3
+    command -v python3 > /dev/null ||
+        die "Can't find python3, which the tests need"
+
     # Compile
     make > /dev/null 2>&1 ||
         die "Compilation failed"
 
-    local execs=("test_fs.x" "fs_make.x" "fs_ref.x")
+    local execs=("test_fs.x" "fs_make.x" "fs_ref.x" "fs_bench.x" "fs_check.x")
 
     # Make sure executables were properly created
     local x
@@ -273,5 +834,10 @@ make_fs() {
     done
 }
 
+PERF_REGRESSIONS=0
+
 make_fs
 run_tests
+
+[[ ${PERF_REGRESSIONS} -eq 0 ]] ||
+    die "${PERF_REGRESSIONS} performance regression(s)"
@@ -0,0 +1,282 @@
+#include <pthread.h>
+#include <stddef.h>
+
+#include "async.h"
+#include "fs.h"
+#include "pool.h"
+
+/* Number of worker threads serving the submitted requests */
+#define ASYNC_WORKERS 4
+
+/* Number of request objects allocated at once */
+#define ASYNC_SLAB_OBJECTS 64
+
+/* Submitted request, on the pending queue then on the completion queue */
+struct async_request {
+	struct async_request *next;
+	/* Whether the request is a write */
+	int write;
+	/* Arguments of the fs_pread()/fs_pwrite() call */
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	/* Caller's tag, and result of the call */
+	void *tag;
+	int result;
+};
+
+/* FIFO of requests */
+struct async_queue {
+	struct async_request *head;
+	struct async_request *tail;
+};
+
+/* Set by fs_mount(), cleared by fs_umount() */
+extern int mounted;
+
+/* Protects everything below */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signaled when a request is submitted, or when the workers must stop */
+static pthread_cond_t async_submitted = PTHREAD_COND_INITIALIZER;
+
+/* Signaled when a request completes */
+static pthread_cond_t async_completed = PTHREAD_COND_INITIALIZER;
+
+static struct async_queue pending;
+
+static struct async_queue completed;
+
+/* Number of requests submitted but not completed yet */
+static size_t inflight;
+
+/* Number of completions not reaped yet */
+static size_t unreaped;
+
+static pthread_t workers[ASYNC_WORKERS];
+
+static int started;
+
+static int stopping;
+
+/* Set by async_quiesce(): submissions fail */
+static int quiesced;
+
+static struct pool *requests;
+
+static void queue_push(struct async_queue *queue, struct async_request *req)
+{
+	req->next = NULL;
+	if (queue->tail)
+		queue->tail->next = req;
+	else
+		queue->head = req;
+	queue->tail = req;
+}
+
+static struct async_request *queue_pop(struct async_queue *queue)
+{
+	struct async_request *req = queue->head;
+
+	if (req) {
+		queue->head = req->next;
+		if (!queue->head)
+			queue->tail = NULL;
+	}
+
+	return req;
+}
+
+static void *async_worker(void *arg)
+{
+	struct async_request *req;
+
+	(void)arg;
+
+	pthread_mutex_lock(&async_lock);
+	for (;;) {
+		while (!pending.head && !stopping)
+			pthread_cond_wait(&async_submitted, &async_lock);
+
+		req = queue_pop(&pending);
+		if (!req)
+			break;
+		pthread_mutex_unlock(&async_lock);
+
+		if (req->write)
+			req->result = fs_pwrite(req->fd, req->buf, req->count,
+						req->offset);
+		else
+			req->result = fs_pread(req->fd, req->buf, req->count,
+					       req->offset);
+
+		pthread_mutex_lock(&async_lock);
+		queue_push(&completed, req);
+		inflight--;
+		unreaped++;
+		pthread_cond_broadcast(&async_completed);
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return NULL;
+}
+
+/* Start the workers if they are not running (async_lock held) */
+static int async_start(void)
+{
+	int i;
+
+	if (started)
+		return 0;
+
+	requests = pool_create(sizeof(struct async_request), ASYNC_SLAB_OBJECTS);
+	if (!requests)
+		return -1;
+
+	stopping = 0;
+	for (i = 0; i < ASYNC_WORKERS; i++) {
+		if (pthread_create(&workers[i], NULL, async_worker, NULL))
+			break;
+	}
+
+	/* Not a single worker, nothing would ever complete */
+	if (i == 0) {
+		pool_destroy(requests);
+		requests = NULL;
+		return -1;
+	}
+	started = i;
+
+	return 0;
+}
+
+int async_quiesce(void)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&async_lock);
+	if (!inflight && !unreaped) {
+		quiesced = 1;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return ret;
+}
+
+void async_resume(void)
+{
+	pthread_mutex_lock(&async_lock);
+	quiesced = 0;
+	pthread_mutex_unlock(&async_lock);
+}
+
+void async_stop(void)
+{
+	int i, count;
+
+	pthread_mutex_lock(&async_lock);
+	count = started;
+	stopping = 1;
+	pthread_cond_broadcast(&async_submitted);
+	pthread_mutex_unlock(&async_lock);
+
+	for (i = 0; i < count; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_mutex_lock(&async_lock);
+	pool_destroy(requests);
+	requests = NULL;
+	started = 0;
+	quiesced = 0;
+	pthread_mutex_unlock(&async_lock);
+}
+
+static int async_submit(int write, int fd, void *buf, size_t count,
+			size_t offset, void *tag)
+{
+	struct async_request *req;
+
+	if (!mounted || !buf)
+		return -1;
+
+	pthread_mutex_lock(&async_lock);
+	if (quiesced || async_start() || !(req = pool_get(requests))) {
+		pthread_mutex_unlock(&async_lock);
+		return -1;
+	}
+
+	req->write = write;
+	req->fd = fd;
+	req->buf = buf;
+	req->count = count;
+	req->offset = offset;
+	req->tag = tag;
+	req->result = -1;
+
+	queue_push(&pending, req);
+	inflight++;
+	pthread_cond_signal(&async_submitted);
+	pthread_mutex_unlock(&async_lock);
+
+	return 0;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, size_t offset, void *tag)
+{
+	return async_submit(0, fd, buf, count, offset, tag);
+}
+
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+		   void *tag)
+{
+	return async_submit(1, fd, (void *)buf, count, offset, tag);
+}
+
+/* Move up to @max completions to @events (async_lock held) */
+static int async_reap(struct fs_completion *events, int max)
+{
+	struct async_request *req;
+	int n = 0;
+
+	while (n < max && (req = queue_pop(&completed))) {
+		events[n].tag = req->tag;
+		events[n].result = req->result;
+		pool_put(requests, req);
+		unreaped--;
+		n++;
+	}
+
+	return n;
+}
+
+int fs_async_poll(struct fs_completion *events, int max)
+{
+	int n;
+
+	if (!events || max < 1)
+		return -1;
+
+	pthread_mutex_lock(&async_lock);
+	n = async_reap(events, max);
+	pthread_mutex_unlock(&async_lock);
+
+	return n;
+}
+
+int fs_async_wait(struct fs_completion *events, int max)
+{
+	int n;
+
+	if (!events || max < 1)
+		return -1;
+
+	pthread_mutex_lock(&async_lock);
+	while (!completed.head && inflight)
+		pthread_cond_wait(&async_completed, &async_lock);
+	n = async_reap(events, max);
+	pthread_mutex_unlock(&async_lock);
+
+	return n;
+}
@@ -0,0 +1,33 @@
+#ifndef _ASYNC_H
+#define _ASYNC_H
+
+/**
+ * async_quiesce - Refuse new asynchronous requests
+ *
+ * Make fs_read_async() and fs_write_async() fail until async_resume() or
+ * async_stop() is called, so that the workers stay idle while the file system
+ * is being unmounted.
+ *
+ * Return: -1 if requests are still pending or running, or if completions have
+ * not been reaped yet (new requests are still accepted then). 0 otherwise.
+ */
+int async_quiesce(void);
+
+/**
+ * async_resume - Accept asynchronous requests again
+ *
+ * Undo async_quiesce(), when the unmount it prepared for does not happen.
+ */
+void async_resume(void);
+
+/**
+ * async_stop - Stop the asynchronous I/O workers
+ *
+ * Stop the worker threads started by the first fs_read_async() or
+ * fs_write_async() call, and release the request objects. Must follow a
+ * successful async_quiesce(). The workers are started again by the next
+ * submission.
+ */
+void async_stop(void);
+
+#endif /* _ASYNC_H */
@@ -1,8 +1,11 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -10,6 +13,9 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
+/* Maximum number of blocks written by a single vectored write */
+#define BATCH_MAX_IOV 64
+
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
@@ -19,6 +25,8 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* I/O counters since the disk was opened (updated atomically) */
+	struct block_stat stat;
 };
 
 /* Currently open virtual disk (invalid by default) */
@@ -58,6 +66,33 @@ int block_disk_open(const char *diskname)
 
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.stat = (struct block_stat){ 0 };
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t count)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	/* Truncated to nothing first, so that every block becomes a hole */
+	if ((fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (ftruncate(fd, (off_t)count * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
 
 	return 0;
 }
@@ -76,6 +111,22 @@ int block_disk_close(void)
 	return 0;
 }
 
+int block_disk_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (fdatasync(disk.fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+	__atomic_add_fetch(&disk.stat.syncs, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
 int block_disk_count(void)
 {
 	if (disk.fd == INVALID_FD) {
@@ -86,6 +137,20 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+int block_disk_stat(struct block_stat *st)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	st->reads = __atomic_load_n(&disk.stat.reads, __ATOMIC_RELAXED);
+	st->writes = __atomic_load_n(&disk.stat.writes, __ATOMIC_RELAXED);
+	st->syncs = __atomic_load_n(&disk.stat.syncs, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
 int block_write(size_t block, const void *buf)
 {
 	if (disk.fd == INVALID_FD) {
@@ -99,17 +164,16 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
-
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/*
+	 * Perform the actual write into the disk image, at the specified block
+	 * number (positional, so that concurrent callers don't race on the file
+	 * offset)
+	 */
+	if (pwrite(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
 		return -1;
 	}
+	__atomic_add_fetch(&disk.stat.writes, 1, __ATOMIC_RELAXED);
 
 	return 0;
 }
@@ -127,18 +191,127 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/*
+	 * Perform the actual read from the disk image, at the specified block
+	 * number (positional, so that concurrent callers don't race on the file
+	 * offset)
+	 */
+	if (pread(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
 		return -1;
 	}
+	__atomic_add_fetch(&disk.stat.reads, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+int block_write_many(const size_t *blocks, const void **bufs, size_t count)
+{
+	struct iovec iov[BATCH_MAX_IOV];
+	size_t i, run;
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
+	for (i = 0; i < count; i++) {
+		if (blocks[i] >= disk.bcount) {
+			block_error("block index out of bounds (%zu/%zu)",
+				    blocks[i], disk.bcount);
+			return -1;
+		}
+		if (i && blocks[i] <= blocks[i - 1]) {
+			block_error("batch is not sorted (%zu after %zu)",
+				    blocks[i], blocks[i - 1]);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < count; i += run) {
+		/* Gather the run of consecutive blocks starting at @i */
+		for (run = 0; i + run < count && run < BATCH_MAX_IOV; run++) {
+			if (run && blocks[i + run] != blocks[i] + run)
+				break;
+			iov[run].iov_base = (void *)bufs[i + run];
+			iov[run].iov_len = BLOCK_SIZE;
+		}
+
+		if (pwritev(disk.fd, iov, run, blocks[i] * BLOCK_SIZE) < 0) {
+			perror("pwritev");
+			return -1;
+		}
+	}
+	__atomic_add_fetch(&disk.stat.writes, count, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* Copy @len bytes at byte @pos of the disk to @out_fd through a buffer */
+static int block_send_copy(off_t pos, size_t len, int out_fd)
+{
+	char buf[BLOCK_SIZE];
+	ssize_t n, w, done;
+
+	while (len > 0) {
+		n = pread(disk.fd, buf, len < BLOCK_SIZE ? len : BLOCK_SIZE, pos);
+		if (n <= 0) {
+			perror("pread");
+			return -1;
+		}
+		for (done = 0; done < n; done += w) {
+			w = write(out_fd, buf + done, n - done);
+			if (w < 0) {
+				perror("write");
+				return -1;
+			}
+		}
+		pos += n;
+		len -= n;
+	}
+
 	return 0;
 }
 
+int block_send(size_t block, size_t offset, size_t len, int out_fd)
+{
+	off_t pos;
+	ssize_t n;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block * BLOCK_SIZE + offset + len > disk.bcount * BLOCK_SIZE) {
+		block_error("range out of bounds (%zu+%zu/%zu)",
+			    block * BLOCK_SIZE + offset, len,
+			    disk.bcount * BLOCK_SIZE);
+		return -1;
+	}
+
+	/* Counted as reads of every block the range spans */
+	__atomic_add_fetch(&disk.stat.reads,
+			   len ? (offset + len - 1) / BLOCK_SIZE + 1 : 0,
+			   __ATOMIC_RELAXED);
+
+	pos = block * BLOCK_SIZE + offset;
+	while (len > 0) {
+		n = sendfile(out_fd, disk.fd, &pos, len);
+		if (n < 0) {
+			/* Descriptors sendfile() cannot handle, copy by hand */
+			if (errno == EINVAL || errno == ENOSYS)
+				return block_send_copy(pos, len, out_fd);
+			perror("sendfile");
+			return -1;
+		}
+		if (n == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		len -= n;
+	}
+
+	return 0;
+}
@@ -19,6 +19,20 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_create - Create a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the disk
+ *
+ * Create virtual disk file @diskname, or truncate it if it exists, with
+ * @count blocks filled with zeros. The file is sparse: the blocks take no
+ * space on the host until they are written.
+ *
+ * Return: -1 if @diskname is invalid, or if the file cannot be created or
+ * resized. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t count);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +40,17 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Make the writes to the virtual disk durable
+ *
+ * Wait until every block written so far has reached the storage holding the
+ * virtual disk file, with fdatasync().
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the
+ * synchronization fails. 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,6 +59,28 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/** Block I/O counters, as filled by block_disk_stat() */
+struct block_stat {
+	/* Number of blocks read */
+	size_t reads;
+	/* Number of blocks written */
+	size_t writes;
+	/* Number of calls to block_disk_sync() */
+	size_t syncs;
+};
+
+/**
+ * block_disk_stat - Get disk's I/O counters
+ * @st: Structure to be filled with the counters
+ *
+ * The counters start from zero when the disk is opened. A block transferred
+ * as part of a batch (block_write_many()) or of a range (block_send()) counts
+ * as one block read or written.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_disk_stat(struct block_stat *st);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -60,5 +107,37 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_many - Write a batch of blocks to disk
+ * @blocks: Array of @count block indexes, in ascending order
+ * @bufs: Array of @count data buffers (%BLOCK_SIZE bytes each)
+ * @count: Number of blocks in the batch
+ *
+ * Write the content of buffer @bufs[i] in the virtual disk's block @blocks[i],
+ * for every block of the batch. Runs of consecutive block indexes are written
+ * with a single vectored write.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, if @blocks is not
+ * sorted, or if a writing operation fails. 0 otherwise.
+ */
+int block_write_many(const size_t *blocks, const void **bufs, size_t count);
+
+/**
+ * block_send - Copy bytes of the disk to a host file descriptor
+ * @block: Index of the first block to copy from
+ * @offset: Offset of the first byte to copy, from the start of @block
+ * @len: Number of bytes to copy
+ * @out_fd: Host file descriptor to write to, at its current file offset
+ *
+ * Copy @len bytes of the virtual disk, starting @offset bytes into block
+ * @block (the range can span several consecutive blocks), to @out_fd. The
+ * copy is done by the kernel with sendfile() when possible, and otherwise
+ * through a buffer of %BLOCK_SIZE bytes.
+ *
+ * Return: -1 if the range is out of bounds, or if a reading or writing
+ * operation fails. 0 otherwise.
+ */
+int block_send(size_t block, size_t offset, size_t len, int out_fd);
+
 #endif /* _DISK_H */
 
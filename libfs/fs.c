@@ -1,18 +1,66 @@
-#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <unistd.h>
 
+#include "async.h"
 #include "disk.h"
 #include "fs.h"
+#include "pool.h"
 
 #define FAT_EOC 0xFFFF
 
+/* Signature of the superblock extension fields */
+#define EXT_SIGNATURE "ECSX"
+
+/* Largest file tail stored in a shared pack block instead of a data block */
+#define TAIL_PACK_MAX (BLOCK_SIZE / 2)
+
+/* Number of chunks of FS_OPEN_MAX_COUNT descriptors in the open file table */
+#define FD_CHUNK_COUNT 1024
+
+/* Root entry flag: the file's chain holds a block map (FS_FEATURE_SPARSE) */
+#define FILE_MAPPED 0x1
+
+/* Number of block map entries held by a map block */
+#define MAP_ENTRIES (BLOCK_SIZE / 2)
+
+/* Signature of a journal transaction */
+#define JOURNAL_MAGIC 0x4a534345
+
+/* Size of the journal created by fs_set_features(), at most 1/8 of the disk */
+#define JOURNAL_BLOCKS 32
+
+/* Journal record types */
+#define JOURNAL_SUPER 1
+#define JOURNAL_FAT 2
+#define JOURNAL_ROOT 3
+#define JOURNAL_REFCOUNT 4
+#define JOURNAL_SUPER_EXT 5
+
+/* Largest run of consecutive blocks handed to the disk by one send */
+#define SEND_RUN_MAX 64
+
+/* Number of blocks kept by the block cache */
+#define CACHE_BLOCKS 256
+
+/* Number of objects allocated at once by the buffer and open file pools */
+#define BUFFER_SLAB_OBJECTS 16
+#define FILE_SLAB_OBJECTS 32
+
+/* Largest number of threads walking the chains in fs_check() */
+#define CHECK_THREADS_MAX 8
+
+/* Problems of a root entry found by fs_check() */
+#define CHECK_BROKEN 0x1
+#define CHECK_CYCLIC 0x2
+#define CHECK_LENGTH 0x4
+#define CHECK_TAIL 0x8
+#define CHECK_MAP 0x10
+
 struct superblock {
 	/* Signature "ECS150FS" */
 	uint32_t signature[2];
@@ -27,8 +75,63 @@ struct superblock {
 	/* Number of blocks for FAT */
 	uint8_t FAT_count;
 	/* Unused / Padding */
-	uint32_t Padding_4076[1019];
 	uint8_t Padding_3[3];
+	/* Signature "ECSX" if the extension fields below are in use */
+	uint32_t ext_signature;
+	/* Enabled optional features (FS_FEATURE_*) */
+	uint32_t features;
+	/* First data block of the reference count table (FS_FEATURE_REFLINK) */
+	uint16_t refcount_block;
+	/* First data block of the journal (FS_FEATURE_JOURNAL) */
+	uint16_t journal_block;
+	/* Number of blocks of the journal */
+	uint16_t journal_count;
+	/* Data block of the snapshot table (FS_FEATURE_SNAPSHOT) */
+	uint16_t snapshot_block;
+	/* Sequence number of the first transaction after the last checkpoint */
+	uint32_t journal_seq;
+	/* Unused / Padding */
+	uint32_t Padding_4056[1014];
+};
+
+/* Header of a journal transaction, followed by its records */
+struct journal_header {
+	/* JOURNAL_MAGIC */
+	uint32_t magic;
+	/* Sequence number, one more than the previous transaction */
+	uint32_t seq;
+	/* Size of the records (in bytes) */
+	uint32_t length;
+	/* CRC-32 of the header (with a zero checksum) and the records */
+	uint32_t checksum;
+};
+
+/*
+ * Journal record, followed by the root entry for JOURNAL_ROOT and by the
+ * superblock extension fields for JOURNAL_SUPER_EXT. JOURNAL_SUPER, which only
+ * carries the features and the reference count table block, is no longer
+ * written but still replayed.
+ */
+struct journal_record {
+	/* JOURNAL_* */
+	uint16_t type;
+	/* FAT or reference count entry, root slot, or reference count table block */
+	uint16_t index;
+	/* New value of the entry, or features for JOURNAL_SUPER */
+	uint32_t value;
+};
+
+/*
+ * Extension fields of the superblock, as logged by JOURNAL_SUPER_EXT (the
+ * sequence number belongs to the checkpoints, and is not logged)
+ */
+struct journal_super {
+	uint32_t ext_signature;
+	uint32_t features;
+	uint16_t refcount_block;
+	uint16_t journal_block;
+	uint16_t journal_count;
+	uint16_t snapshot_block;
 };
 
 struct file_entry {
@@ -38,14 +141,58 @@ struct file_entry {
 	uint32_t size;
 	/* Index of the first data block */
 	uint16_t index;
+	/* Data block holding the packed tail of the file (0 if not packed) */
+	uint16_t tail_block;
+	/* Offset of the packed tail within its data block */
+	uint16_t tail_offset;
+	/* Layout flags (FILE_MAPPED) */
+	uint16_t flags;
 	/* Unused / Padding */
-	uint16_t Padding_10[5];
+	uint16_t Padding_4[2];
+};
+
+/* In-memory state shared by every descriptor open on the same file */
+struct ECS150file {
+	/* Root directory slot of the file */
+	int slot;
+	/* Size of the file (in bytes), mirrors the root entry */
+	size_t size;
+	/* Index of the first data block, mirrors the root entry */
+	uint16_t index;
+	/* Number of file descriptors referencing the file */
+	int refs;
+	/* Held for reading to access the file, for writing to modify it */
+	pthread_rwlock_t lock;
+	/*
+	 * Last data block of the file, kept in memory for append descriptors
+	 * (FS_OPEN_APPEND) so that appends neither walk the chain nor read the
+	 * block back. Bytes appended to it reach the disk when the block fills
+	 * up, or before anything else reads or changes the file.
+	 */
+	uint8_t *append_data;
+	/* Block held by append_data, FAT_EOC if the file has no block yet */
+	uint16_t append_block;
+	/* Whether append_data holds bytes not written to the disk yet */
+	int append_dirty;
+	/* Protects the three fields above */
+	pthread_mutex_t append_lock;
+	/*
+	 * Whether the chain can hold blocks shared with a copy or a snapshot of
+	 * the file; writes to a file without any skip the copy on write checks
+	 */
+	int shared;
 };
 
+/* Entry of the open file table, indexed by file descriptor */
 struct ECS150fd {
-	char filename[16];
-	int fd;
-	int offset;
+	/* Open file, NULL if the descriptor is unused */
+	struct ECS150file *file;
+	/* File offset */
+	size_t offset;
+	/* Flags given to fs_open_flags() (FS_OPEN_*) */
+	int flags;
+	/* Serializes the calls using or moving the file offset */
+	pthread_mutex_t offset_lock;
 };
 
 /* Global variables */
@@ -57,615 +204,6351 @@ struct file_entry Root[FS_FILE_MAX_COUNT];
 
 int mounted = 0;
 
+/* Mounted snapshot, nothing can be modified */
+int readonly = 0;
+
 int fd_count = 0;
 
-struct ECS150fd fds[FS_OPEN_MAX_COUNT];
+/*
+ * Open file table, as chunks of FS_OPEN_MAX_COUNT descriptors allocated on
+ * demand. Chunks never move once published, so descriptors are resolved
+ * without taking any lock.
+ */
+struct ECS150fd *fds[FD_CHUNK_COUNT];
+
+/* Open files, indexed by root directory slot */
+struct ECS150file *files[FS_FILE_MAX_COUNT];
+
+/*
+ * Locks, always taken in this order: the lock of an open file, then
+ * snapshot_lock, then dir_lock, then alloc_lock, then the append lock of an
+ * open file, then the lock of a block cache entry.
+ *
+ * dir_lock protects the root directory, the open file table and the files
+ * array. alloc_lock protects the FAT and the pack blocks. The data blocks of a
+ * file are protected by the lock of the file, so the FAT entries of its chain
+ * can be read while only holding that lock. snapshot_lock is held for reading
+ * while data is written to a file, and for writing while a snapshot is taken.
+ */
+pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Pools of the mounted file system: block-sized staging buffers for partial
+ * block transfers, and open file objects. Both keep per-thread free lists, so
+ * that reads and writes do not touch the heap once the pools are warm.
+ */
+struct pool *buffer_pool;
+
+struct pool *file_pool;
+
+/* Block cache entry */
+struct cache_entry {
+	/* Protects the entry, held across the disk I/O of its block */
+	pthread_mutex_t lock;
+	/* Disk block held by the entry */
+	size_t block;
+	/* Whether the entry holds a block at all */
+	int valid;
+	/* Content of the block */
+	uint8_t data[BLOCK_SIZE];
+};
 
-int fs_mount(const char *diskname)
+/*
+ * Direct-mapped, write-through cache of the blocks accessed partially (head
+ * and tail of reads and writes, packed tails). Whole block transfers bypass it
+ * and only refresh the entry of the block if it is cached. Each entry has its
+ * own lock, so the disk I/O of blocks held by different entries runs
+ * concurrently.
+ */
+struct cache_entry *cache;
+
+/* Metadata modified in memory but not yet written back by fs_sync() */
+int superblock_dirty = 0;
+
+uint8_t *FAT_dirty;
+
+int root_dirty = 0;
+
+/*
+ * Reference count table (FS_FEATURE_REFLINK): for every data block, the number
+ * of references to the block beyond the first one, i.e. 0 for a block used by
+ * a single chain. A block is referenced by the root entries whose chain starts
+ * with it and by the FAT entries pointing to it, so sharing a whole chain only
+ * takes one more reference on its first block. The table is stored like the
+ * FAT, in refcount_count data blocks chained from superblock.refcount_block.
+ */
+uint16_t *refcount;
+
+uint16_t *refcount_chain;
+
+uint8_t *refcount_dirty;
+
+size_t refcount_count = 0;
+
+/* Number of data blocks with a non-zero count in the table */
+size_t shared_blocks = 0;
+
+/*
+ * Snapshot table (FS_FEATURE_SNAPSHOT), one data block: for every snapshot
+ * identifier, the data block holding the frozen copy of the root directory, 0
+ * if unused. The root entries of a snapshot take a reference on the first
+ * block of their chain and on their pack block, like copies of the files.
+ */
+uint16_t *snapshot_table;
+
+/*
+ * Metadata journal (FS_FEATURE_JOURNAL). A commit logs the FAT entries, root
+ * entries, reference counts and superblock fields changed since the previous
+ * commit as one transaction, written sequentially after the previous ones in
+ * the journal blocks. The committed metadata is kept aside, and only written
+ * in place by a checkpoint, when the journal is full or on unmount; the
+ * journal then restarts from its first block. Mounting replays the
+ * transactions logged since the last checkpoint.
+ */
+struct journal {
+	/* Metadata as of the last commit */
+	struct superblock superblock;
+	uint16_t *FAT;
+	struct file_entry root[FS_FILE_MAX_COUNT];
+	uint16_t *refcount;
+	/* Committed metadata blocks not written in place yet */
+	int superblock_stale;
+	uint8_t *FAT_stale;
+	int root_stale;
+	uint8_t *refcount_stale;
+	/* Number of reference count blocks covered by @refcount_stale */
+	size_t refcount_count;
+	/* Block of the journal where the next transaction goes */
+	size_t head;
+	/* Sequence number of the next transaction */
+	uint32_t seq;
+	/* Metadata layout changed, the next commit writes everything in place */
+	int rewrite;
+} journal;
+
+/*
+ * Group commit of fs_fsync(): every call takes a ticket, and a commit covers
+ * every ticket taken before it started. Only one commit runs at a time, the
+ * calls arriving meanwhile wait for the next one (sync_lock protects these).
+ */
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+
+/* Last ticket taken, and last ticket covered by a successful commit */
+uint64_t sync_ticket = 0;
+
+uint64_t sync_done = 0;
+
+/* Whether a commit is running */
+int sync_running = 0;
+
+/* Set FAT entry @block to @value and mark its FAT block dirty (alloc_lock held) */
+void fat_set(uint16_t block, uint16_t value)
 {
-	if (block_disk_open(diskname)) {
+	FAT[block] = value;
 
-		return -1;
+	FAT_dirty[block / 2048] = 1;
+}
 
-	}
+/* Write every dirty metadata block in place, in one sorted batch (all locks held) */
+int metadata_write(void)
+{
+	/* superblock, FAT blocks, root directory, reference count blocks */
+	size_t blocks[superblock.FAT_count + 2 + refcount_count];
 
-	block_read(0, &superblock);
+	const void *bufs[superblock.FAT_count + 2 + refcount_count];
 
-	char sig[8] = {'E','C','S','1','5','0','F','S'};
+	size_t count = 0;
 
-	if (memcmp(&superblock.signature, &sig, 8)) {
+	if (superblock_dirty) {
 
-		return -1;
+		blocks[count] = 0;
+
+		bufs[count++] = &superblock;
 
 	}
 
-	FAT = (uint16_t *) malloc(sizeof(uint16_t) * 2048 * superblock.FAT_count);
+	for (int i = 0; i < superblock.FAT_count; i++) {
 
-	uint16_t *tmp_fat = FAT;
+		if (FAT_dirty[i]) {
 
-	for (int i = 0; i < superblock.FAT_count; i++) {
+			blocks[count] = i + 1;
 
-		block_read(i + 1, tmp_fat);
+			bufs[count++] = FAT + 2048 * i;
 
-		tmp_fat = tmp_fat + 2048;
+		}
+	}
+
+	if (root_dirty) {
+
+		blocks[count] = superblock.root;
+
+		bufs[count++] = &Root[0];
 
 	}
 
-	block_read(superblock.root, &Root[0]);
+	/* reference count blocks are data blocks, after the root directory */
+	for (size_t i = 0; i < refcount_count; i++) {
+
+		if (!refcount_dirty[i]) {
+
+			continue;
+
+		}
+
+		/* insertion sort by block index */
+		size_t k = count++;
+
+		size_t block = superblock.data + refcount_chain[i];
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		while (k > 0 && blocks[k - 1] > block) {
 
-		fds[i].fd = -1;
+			blocks[k] = blocks[k - 1];
 
-		fds[i].offset = 0;
+			bufs[k] = bufs[k - 1];
+
+			k--;
+
+		}
+
+		blocks[k] = block;
+
+		bufs[k] = refcount + 2048 * i;
 
 	}
 
-	mounted = 1;
+	if (block_write_many(blocks, bufs, count)) {
+
+		return -1;
+
+	}
+
+	superblock_dirty = 0;
+
+	memset(FAT_dirty, 0, superblock.FAT_count);
+
+	root_dirty = 0;
+
+	if (refcount_count > 0) {
+
+		memset(refcount_dirty, 0, refcount_count);
+
+	}
 
 	return 0;
 }
 
-int fs_umount(void)
+/* Allocate the block cache, with every entry empty */
+struct cache_entry *cache_create(void)
 {
-	/* no disk mounted */
-	if (!mounted) {
+	struct cache_entry *entries = (struct cache_entry *) calloc(CACHE_BLOCKS, sizeof(struct cache_entry));
 
-		return -1;
+	if (entries == NULL) {
+
+		return NULL;
 
 	}
 
-	block_write(0, &superblock);
+	for (int i = 0; i < CACHE_BLOCKS; i++) {
 
-	uint16_t *tmp_fat = FAT;
+		pthread_mutex_init(&entries[i].lock, NULL);
 
-	for (int i = 0; i < superblock.FAT_count; i++) {
+	}
 
-		block_write(i + 1, tmp_fat);
+	return entries;
+}
 
-		tmp_fat = tmp_fat + 2048;
+void cache_destroy(struct cache_entry *entries)
+{
+	if (entries == NULL) {
+
+		return;
+
+	}
+
+	for (int i = 0; i < CACHE_BLOCKS; i++) {
+
+		pthread_mutex_destroy(&entries[i].lock);
 
 	}
 
-	block_write(superblock.root, &Root[0]);
+	free(entries);
+}
+
+/* Lock and return the entry that block @block maps to */
+struct cache_entry *cache_lock(size_t block)
+{
+	struct cache_entry *entry = &cache[block % CACHE_BLOCKS];
+
+	pthread_mutex_lock(&entry->lock);
+
+	return entry;
+}
+
+/* Fill locked @entry with block @block from disk on a miss */
+int cache_fill(struct cache_entry *entry, size_t block)
+{
+	if (!entry->valid || entry->block != block) {
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		entry->valid = 0;
 
-		if (fds[i].fd != -1) {
+		if (block_read(block, entry->data)) {
 
 			return -1;
 
 		}
-	}
 
-	if (block_disk_close()) {
+		entry->block = block;
 
-		return -1;
+		entry->valid = 1;
 
 	}
 
-	free(FAT);
-
-	mounted = 0;
-
 	return 0;
 }
 
-int fs_info(void)
+/* Read @len bytes at byte @offset of disk block @block into @buf */
+int cache_read(size_t block, void *buf, size_t offset, size_t len)
 {
-	/* no disk mounted */
-	if (!mounted) {
+	struct cache_entry *entry = cache_lock(block);
 
-		return -1;
+	int ret = cache_fill(entry, block);
+
+	if (ret == 0) {
+
+		memcpy(buf, entry->data + offset, len);
 
 	}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", superblock.total_block_disk);
-	printf("fat_blk_count=%d\n", superblock.FAT_count);
-	printf("rdir_blk=%d\n", superblock.root);
-	printf("data_blk=%d\n", superblock.data);
-	printf("data_blk_count=%d\n", superblock.total_data_blocks);
+	pthread_mutex_unlock(&entry->lock);
 
-	int free_fat_count = 0;
+	return ret;
+}
 
-	uint16_t *tmp_fat = FAT;
+/* Write @len bytes of @buf at byte @offset of disk block @block (read-modify-write) */
+int cache_write(size_t block, const void *buf, size_t offset, size_t len)
+{
+	uint8_t data[BLOCK_SIZE];
 
-	for (int i = 0; i < superblock.total_data_blocks; i++) {
+	struct cache_entry *entry = cache_lock(block);
 
-		if (*tmp_fat == 0) {
+	int ret = cache_fill(entry, block);
 
-			free_fat_count++;
+	/* the entry only changes once the disk has the new content */
+	if (ret == 0) {
 
-		}
+		memcpy(data, entry->data, BLOCK_SIZE);
 
-		tmp_fat++;
+		memcpy(data + offset, buf, len);
+
+		ret = block_write(block, data);
 
 	}
 
-	printf("fat_free_ratio=%d/%d\n", free_fat_count, superblock.total_data_blocks);
+	if (ret == 0) {
 
-	int free_root_count = 0;
+		memcpy(entry->data, data, BLOCK_SIZE);
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+	}
 
-		uint8_t empty = '\0';
+	pthread_mutex_unlock(&entry->lock);
 
-		if(!memcmp(&Root[i].filename, &empty, 1)) {
+	return ret;
+}
+
+/* Write the whole disk block @block from @buf, with no read beforehand */
+int cache_write_block(size_t block, const void *buf)
+{
+	struct cache_entry *entry = cache_lock(block);
 
-			free_root_count++;
+	int ret = block_write(block, buf);
+
+	if (ret == 0 && entry->valid && entry->block == block) {
+
+		memcpy(entry->data, buf, BLOCK_SIZE);
 
-		}
 	}
 
-	printf("rdir_free_ratio=%d/%d\n", free_root_count, FS_FILE_MAX_COUNT);
+	pthread_mutex_unlock(&entry->lock);
 
-	return 0;
+	return ret;
 }
 
-int fs_create(const char *filename)
+/* Check that @filename is NULL-terminated and fits in a root entry */
+int filename_valid(const char *filename)
 {
-	/* no disk mounted */
-	if (!mounted) {
+	if (filename == NULL) {
 
-		return -1;
+		return 0;
 
 	}
 
-	/* invalid filename */
-	if (strlen(filename) > FS_FILENAME_LEN - 1) {
-		
-		return -1;
+	if (strnlen(filename, FS_FILENAME_LEN) > FS_FILENAME_LEN - 1) {
+
+		return 0;
 
 	}
 
-	char empty = '\0';
+	return filename[0] != '\0';
+}
 
-	/* not null terminated */
-	if (memcmp(filename + strlen(filename), &empty, 1)) {
+/* Return the root slot holding @filename, or -1 if there is none */
+int root_find(const char *filename)
+{
+	if (filename[0] == '\0') {
 
 		return -1;
 
 	}
 
-	/* existing filename */
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
 
-		if(!memcmp(&Root[i].filename, filename, strlen(filename))) {
+		if (!strncmp((char *) &Root[i].filename, filename, FS_FILENAME_LEN)) {
 
-			return -1;
+			return i;
 
 		}
 	}
 
-	int first_root_empty_index = -1;
+	return -1;
+}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+/* Return the open file table entry of descriptor @fd, or NULL if @fd is out of bound */
+struct ECS150fd *fd_slot(int fd)
+{
+	/* out of bound */
+	if (fd < 0 || fd >= FD_CHUNK_COUNT * FS_OPEN_MAX_COUNT) {
 
-		uint8_t empty = '\0';
+		return NULL;
 
-		if(!memcmp(&Root[i].filename, &empty, 1)) {
+	}
 
-				first_root_empty_index = i;
-				break;
+	struct ECS150fd *chunk = __atomic_load_n(&fds[fd / FS_OPEN_MAX_COUNT], __ATOMIC_ACQUIRE);
+
+	if (chunk == NULL) {
+
+		return NULL;
 
-		}
 	}
 
-	/* no more space */
-	if (first_root_empty_index == -1) {
+	return &chunk[fd % FS_OPEN_MAX_COUNT];
+}
 
-		return -1;
+/*
+ * Take a reference on the open file of descriptor @fd, so that it stays valid
+ * until fd_put() even if the descriptor is closed meanwhile, and set @entry to
+ * the open file table entry of @fd.
+ *
+ * Return: the open file, or NULL if @fd is invalid.
+ */
+struct ECS150file *fd_entry(int fd, struct ECS150fd **entry)
+{
+	*entry = fd_slot(fd);
+
+	if (*entry == NULL) {
+
+		return NULL;
 
 	}
 
-	memcpy(&Root[first_root_empty_index].filename, filename, strlen(filename) + 1);
+	pthread_mutex_lock(&dir_lock);
 
-	Root[first_root_empty_index].size = 0;
+	struct ECS150file *file = (*entry)->file;
 
-	Root[first_root_empty_index].index = FAT_EOC;
+	if (file != NULL) {
 
-	block_write(superblock.root, &Root[0]);
+		file->refs++;
 
-	open(filename, O_CREAT, 0644);
+	}
 
-	return 0;
+	pthread_mutex_unlock(&dir_lock);
+
+	return file;
 }
 
-int fs_delete(const char *filename)
+/* Set the size of open file @file, in memory and in its root entry */
+void file_set_size(struct ECS150file *file, size_t size)
 {
-	/* no disk mounted */
-	if (!mounted) {
+	file->size = size;
 
-		return -1;
+	pthread_mutex_lock(&dir_lock);
 
-	}
+	Root[file->slot].size = size;
 
-	/* invalid filename */
-	if (strlen(filename) > FS_FILENAME_LEN - 1) {
-		
-		return -1;
+	root_dirty = 1;
+
+	pthread_mutex_unlock(&dir_lock);
+}
+
+/* Set the first data block of open file @file, in memory and in its root entry */
+void file_set_index(struct ECS150file *file, uint16_t index)
+{
+	file->index = index;
+
+	pthread_mutex_lock(&dir_lock);
+
+	Root[file->slot].index = index;
+
+	root_dirty = 1;
+
+	pthread_mutex_unlock(&dir_lock);
+}
+
+/*
+ * Write the bytes appended to the cached last block of @file to the disk.
+ *
+ * Return: -1 if the block cannot be written, in which case it stays to be
+ * written. 0 otherwise.
+ */
+int append_flush(struct ECS150file *file)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&file->append_lock);
+
+	if (file->append_dirty) {
+
+		ret = cache_write_block(superblock.data + file->append_block, file->append_data);
+
+		file->append_dirty = ret != 0;
 
 	}
 
-	char empty = '\0';
+	pthread_mutex_unlock(&file->append_lock);
+
+	return ret;
+}
 
-	/* not null terminated */
-	if (memcmp(filename + strlen(filename), &empty, 1)) {
+/*
+ * Flush and forget the cached last block of @file, before it changes otherwise.
+ *
+ * Return: -1 if the block cannot be written, in which case it stays cached. 0
+ * otherwise.
+ */
+int append_drop(struct ECS150file *file)
+{
+	if (append_flush(file)) {
 
 		return -1;
 
 	}
 
-	int root_file_index = -1;
+	pthread_mutex_lock(&file->append_lock);
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+	pool_put(buffer_pool, file->append_data);
 
-		if(!memcmp(&Root[i].filename, filename, strlen(filename))) {
+	file->append_data = NULL;
 
-				root_file_index = i;
-				break;
+	pthread_mutex_unlock(&file->append_lock);
+
+	return 0;
+}
+
+int find_first_fit()
+{
+	int index = -1;
+
+	uint16_t *tmp_fat = FAT;
+
+	for (int i = 0; i < superblock.total_data_blocks; i++) {
+
+		if (*tmp_fat == 0) {
+			
+			index = i;
+			break;
 
 		}
+		
+		tmp_fat++;
 	}
 
-	/* no file found */
-	if (root_file_index == -1) {
+	return index;
+}
 
-		return -1;
+/* Return the block holding byte @offset of the chain starting at @block */
+uint16_t chain_seek(uint16_t block, size_t offset)
+{
+	for (size_t i = 0; i < offset / BLOCK_SIZE && block != FAT_EOC; i++) {
+
+		block = FAT[block];
 
 	}
 
-	/* currently open */
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+	return block;
+}
+
+/*
+ * Whether root entry @slot uses the mapped layout: its chain is made of map
+ * blocks, whose entries give the data block holding each block of the file (0
+ * for a hole, read as zeros). The data blocks are not chained, their FAT entry
+ * is FAT_EOC.
+ */
+int file_mapped(int slot)
+{
+	return (superblock.features & FS_FEATURE_SPARSE) && (Root[slot].flags & FILE_MAPPED);
+}
+
+/* Position in the map blocks of a mapped file, moving towards its end */
+struct map_cursor {
+	/* Current map block, FAT_EOC past the end of the map */
+	uint16_t map;
+	/* Index of the file block described by the first entry of @map */
+	size_t first;
+	/* Map block before @map, FAT_EOC if none */
+	uint16_t prev;
+};
+
+/* Move @cursor to the map block describing file block @n */
+void map_seek(struct map_cursor *cursor, size_t n)
+{
+	while (cursor->map != FAT_EOC && n >= cursor->first + MAP_ENTRIES) {
 
-		if (!strcmp(&fds[i].filename[0], filename)) {
+		cursor->prev = cursor->map;
 
-			if (fds[i].fd != -1) {
+		cursor->map = FAT[cursor->map];
 
-				return -1;
+		cursor->first += MAP_ENTRIES;
 
-			}			
-		}
 	}
+}
+
+/*
+ * Set @block to the data block holding file block @n, 0 for a hole (file lock
+ * held).
+ *
+ * Return: -1 if the map block cannot be read, leaving @block to FAT_EOC. 0
+ * otherwise.
+ */
+int map_lookup(struct map_cursor *cursor, size_t n, uint16_t *block)
+{
+	*block = 0;
+
+	map_seek(cursor, n);
+
+	if (cursor->map != FAT_EOC && cache_read(superblock.data + cursor->map, block, (n - cursor->first) * sizeof(uint16_t), sizeof(uint16_t))) {
+
+		*block = FAT_EOC;
 
-	uint8_t empty_byte = '\0';
+		return -1;
 
-	memcpy(&Root[root_file_index].filename, &empty_byte, 1);
+	}
 
 	return 0;
 }
 
-int fs_ls(void)
+/*
+ * Make the entry of file block @n in the map block of @cursor point to @block.
+ *
+ * Return: -1 if the map block cannot be written. 0 otherwise.
+ */
+int map_set(struct map_cursor *cursor, size_t n, uint16_t block)
 {
-	/* no disk mounted */
-	if (!mounted) {
+	return cache_write(superblock.data + cursor->map, &block, (n - cursor->first) * sizeof(uint16_t), sizeof(uint16_t));
+}
 
-		return -1;
+/* Count the free data blocks, stopping at @needed (alloc_lock held) */
+size_t free_blocks(size_t needed)
+{
+	size_t count = 0;
+
+	for (int i = 0; i < superblock.total_data_blocks && count < needed; i++) {
+
+		if (FAT[i] == 0) {
+
+			count++;
+
+		}
+	}
+
+	return count;
+}
+
+/* Take one more reference on data block @block (alloc_lock held) */
+void refcount_inc(uint16_t block)
+{
+	if (refcount[block]++ == 0) {
+
+		__atomic_add_fetch(&shared_blocks, 1, __ATOMIC_RELAXED);
+
+	}
+
+	refcount_dirty[block / 2048] = 1;
+}
+
+/*
+ * Drop a reference on data block @block (alloc_lock held).
+ *
+ * Return: 1 if the block is still referenced elsewhere, 0 if the reference was
+ * the last one and the block can be freed.
+ */
+int refcount_drop(uint16_t block)
+{
+	if (refcount == NULL || refcount[block] == 0) {
+
+		return 0;
+
+	}
+
+	if (--refcount[block] == 0) {
+
+		__atomic_sub_fetch(&shared_blocks, 1, __ATOMIC_RELAXED);
+
+	}
+
+	refcount_dirty[block / 2048] = 1;
+
+	return 1;
+}
+
+/* Set the reference count of data block @block to @value (alloc_lock held) */
+void refcount_set(uint16_t block, uint16_t value)
+{
+	if (refcount[block] == 0 && value != 0) {
+
+		__atomic_add_fetch(&shared_blocks, 1, __ATOMIC_RELAXED);
+
+	} else if (refcount[block] != 0 && value == 0) {
+
+		__atomic_sub_fetch(&shared_blocks, 1, __ATOMIC_RELAXED);
+
+	}
+
+	refcount[block] = value;
+
+	refcount_dirty[block / 2048] = 1;
+}
+
+/* Whether data block @block is referenced more than once (alloc_lock held) */
+int refcount_shared(uint16_t block)
+{
+	return refcount != NULL && refcount[block] != 0;
+}
+
+/* Allocate the in-memory reference count table of refcount_count blocks */
+int refcount_alloc(void)
+{
+	refcount = (uint16_t *) calloc(2048 * refcount_count, sizeof(uint16_t));
+
+	refcount_chain = (uint16_t *) calloc(refcount_count, sizeof(uint16_t));
+
+	refcount_dirty = (uint8_t *) calloc(refcount_count, sizeof(uint8_t));
+
+	if (refcount == NULL || refcount_chain == NULL || refcount_dirty == NULL) {
+
+		free(refcount);
+
+		free(refcount_chain);
+
+		free(refcount_dirty);
+
+		refcount = NULL;
+
+		refcount_count = 0;
+
+		return -1;
+
+	}
+
+	__atomic_store_n(&shared_blocks, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* Release the in-memory reference count table */
+void refcount_free(void)
+{
+	free(refcount);
+
+	free(refcount_chain);
+
+	free(refcount_dirty);
+
+	refcount = NULL;
+
+	refcount_chain = NULL;
+
+	refcount_dirty = NULL;
+
+	refcount_count = 0;
+
+	__atomic_store_n(&shared_blocks, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Create an empty reference count table in free data blocks (dir_lock and
+ * alloc_lock held).
+ *
+ * Return: -1 if there are not enough free data blocks or memory. 0 otherwise.
+ */
+int refcount_create(void)
+{
+	refcount_count = (superblock.total_data_blocks + 2047) / 2048;
+
+	if (free_blocks(refcount_count) < refcount_count || refcount_alloc()) {
+
+		refcount_count = 0;
+
+		return -1;
+
+	}
+
+	uint16_t prev = FAT_EOC;
+
+	for (size_t i = 0; i < refcount_count; i++) {
+
+		uint16_t block = find_first_fit();
+
+		fat_set(block, FAT_EOC);
+
+		if (prev == FAT_EOC) {
+
+			superblock.refcount_block = block;
+
+		} else {
+
+			fat_set(prev, block);
+
+		}
+
+		refcount_chain[i] = block;
+
+		refcount_dirty[i] = 1;
+
+		prev = block;
+
+	}
+
+	superblock_dirty = 1;
+
+	/* the journal only logs changes to the table, not its creation */
+	journal.rewrite = 1;
+
+	return 0;
+}
+
+/* Free the blocks of the (unused) reference count table (alloc_lock held) */
+void refcount_destroy(void)
+{
+	for (size_t i = 0; i < refcount_count; i++) {
+
+		fat_set(refcount_chain[i], 0);
+
+	}
+
+	superblock.refcount_block = 0;
+
+	superblock_dirty = 1;
+
+	journal.rewrite = 1;
+
+	refcount_free();
+}
+
+/*
+ * Read the reference count table of the disk being mounted.
+ *
+ * Return: -1 if the chain of the table does not have the expected length, or
+ * if it cannot be read. 0 otherwise.
+ */
+int refcount_load(void)
+{
+	refcount_count = (superblock.total_data_blocks + 2047) / 2048;
+
+	if (refcount_alloc()) {
+
+		return -1;
+
+	}
+
+	uint16_t block = superblock.refcount_block;
+
+	for (size_t i = 0; i < refcount_count; i++) {
+
+		if (block == 0 || block == FAT_EOC || block >= superblock.total_data_blocks || block_read(superblock.data + block, refcount + 2048 * i)) {
+
+			refcount_free();
+
+			return -1;
+
+		}
+
+		refcount_chain[i] = block;
+
+		block = FAT[block];
+
+	}
+
+	for (int i = 0; i < superblock.total_data_blocks; i++) {
+
+		if (refcount[i] != 0) {
+
+			__atomic_add_fetch(&shared_blocks, 1, __ATOMIC_RELAXED);
+
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Start counting references, before the first block gets shared (dir_lock and
+ * alloc_lock held).
+ *
+ * Return: -1 if the reference count table cannot be created. 0 otherwise.
+ */
+int reflink_enable(void)
+{
+	if (superblock.features & FS_FEATURE_REFLINK) {
+
+		return 0;
+
+	}
+
+	if (refcount_create()) {
+
+		return -1;
+
+	}
+
+	memcpy(&superblock.ext_signature, EXT_SIGNATURE, 4);
+
+	superblock.features |= FS_FEATURE_REFLINK;
+
+	superblock_dirty = 1;
+
+	return 0;
+}
+
+/* CRC-32 (IEEE 802.3) of the @len bytes at @buf */
+uint32_t journal_crc(const void *buf, size_t len)
+{
+	const uint8_t *bytes = buf;
+
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (size_t i = 0; i < len; i++) {
+
+		crc ^= bytes[i];
+
+		for (int k = 0; k < 8; k++) {
+
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+
+		}
+	}
+
+	return ~crc;
+}
+
+/* Free the committed copy of the metadata, which disables journaling */
+void journal_free(void)
+{
+	free(journal.FAT);
+
+	free(journal.FAT_stale);
+
+	free(journal.refcount);
+
+	free(journal.refcount_stale);
+
+	journal.FAT = NULL;
+
+	journal.FAT_stale = NULL;
+
+	journal.refcount = NULL;
+
+	journal.refcount_stale = NULL;
+}
+
+/*
+ * Take the current metadata as the committed one, with an empty journal
+ * (dir_lock and alloc_lock held, or during mount).
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int journal_alloc(void)
+{
+	journal.FAT = (uint16_t *) malloc(sizeof(uint16_t) * 2048 * superblock.FAT_count);
+
+	journal.FAT_stale = (uint8_t *) calloc(superblock.FAT_count, sizeof(uint8_t));
+
+	journal.refcount_count = refcount_count;
+
+	if (refcount_count > 0) {
+
+		journal.refcount = (uint16_t *) malloc(sizeof(uint16_t) * 2048 * refcount_count);
+
+		journal.refcount_stale = (uint8_t *) calloc(refcount_count, sizeof(uint8_t));
+
+	}
+
+	if (journal.FAT == NULL || journal.FAT_stale == NULL || (refcount_count > 0 && (journal.refcount == NULL || journal.refcount_stale == NULL))) {
+
+		journal_free();
+
+		return -1;
+
+	}
+
+	memcpy(&journal.superblock, &superblock, sizeof(struct superblock));
+
+	memcpy(journal.FAT, FAT, sizeof(uint16_t) * 2048 * superblock.FAT_count);
+
+	memcpy(journal.root, Root, sizeof(Root));
+
+	if (refcount_count > 0) {
+
+		memcpy(journal.refcount, refcount, sizeof(uint16_t) * 2048 * refcount_count);
+
+	}
+
+	journal.superblock_stale = 0;
+
+	journal.root_stale = 0;
+
+	journal.head = 0;
+
+	journal.seq = superblock.journal_seq;
+
+	journal.rewrite = 0;
+
+	return 0;
+}
+
+/* Mark the committed blocks not written in place yet as dirty, for metadata_write() */
+void journal_unstale(void)
+{
+	superblock_dirty |= journal.superblock_stale;
+
+	for (int i = 0; i < superblock.FAT_count; i++) {
+
+		FAT_dirty[i] |= journal.FAT_stale[i];
+
+	}
+
+	root_dirty |= journal.root_stale;
+
+	/* a table created or destroyed since is written whole, or not at all */
+	if (journal.refcount_count == refcount_count) {
+
+		for (size_t i = 0; i < refcount_count; i++) {
+
+			refcount_dirty[i] |= journal.refcount_stale[i];
+
+		}
+	}
+}
+
+/*
+ * Write the committed metadata in place and make it durable, then point the
+ * superblock past the transactions logged so far, so that the journal can
+ * restart from its first block (all locks held).
+ *
+ * Return: -1 if writing or synchronizing the virtual disk fails. 0 otherwise.
+ */
+int journal_checkpoint(void)
+{
+	size_t blocks[superblock.FAT_count + 1 + journal.refcount_count];
+
+	const void *bufs[superblock.FAT_count + 1 + journal.refcount_count];
+
+	size_t count = 0;
+
+	for (int i = 0; i < superblock.FAT_count; i++) {
+
+		if (journal.FAT_stale[i]) {
+
+			blocks[count] = i + 1;
+
+			bufs[count++] = journal.FAT + 2048 * i;
+
+		}
+	}
+
+	if (journal.root_stale) {
+
+		blocks[count] = superblock.root;
+
+		bufs[count++] = journal.root;
+
+	}
+
+	for (size_t i = 0; i < journal.refcount_count; i++) {
+
+		if (!journal.refcount_stale[i]) {
+
+			continue;
+
+		}
+
+		/* insertion sort by block index */
+		size_t k = count++;
+
+		size_t block = superblock.data + refcount_chain[i];
+
+		while (k > 0 && blocks[k - 1] > block) {
+
+			blocks[k] = blocks[k - 1];
+
+			bufs[k] = bufs[k - 1];
+
+			k--;
+
+		}
+
+		blocks[k] = block;
+
+		bufs[k] = journal.refcount + 2048 * i;
+
+	}
+
+	/* the transactions stay valid until everything they log is on disk */
+	if (block_write_many(blocks, bufs, count) || block_disk_sync()) {
+
+		return -1;
+
+	}
+
+	journal.superblock.journal_seq = journal.seq;
+
+	superblock.journal_seq = journal.seq;
+
+	if (block_write(0, &journal.superblock)) {
+
+		return -1;
+
+	}
+
+	journal.superblock_stale = 0;
+
+	memset(journal.FAT_stale, 0, superblock.FAT_count);
+
+	journal.root_stale = 0;
+
+	if (journal.refcount_count > 0) {
+
+		memset(journal.refcount_stale, 0, journal.refcount_count);
+
+	}
+
+	journal.head = 0;
+
+	return 0;
+}
+
+/*
+ * Write the current metadata in place instead of logging it, and restart the
+ * journal. This is done when the layout of the metadata changes, and for
+ * transactions larger than the journal; as without a journal, a crash in the
+ * middle can leave the metadata torn (all locks held).
+ *
+ * Return: -1 if writing or synchronizing the virtual disk fails, or if memory
+ * cannot be allocated. 0 otherwise.
+ */
+int journal_reset(void)
+{
+	journal_unstale();
+
+	superblock.journal_seq = journal.seq;
+
+	superblock_dirty = 1;
+
+	if (metadata_write() || block_disk_sync()) {
+
+		return -1;
+
+	}
+
+	journal_free();
+
+	return journal_alloc();
+}
+
+/* Copy the logged extension fields of superblock @sb to @ext */
+void journal_super_get(struct journal_super *ext, const struct superblock *sb)
+{
+	*ext = (struct journal_super) { sb->ext_signature, sb->features, sb->refcount_block, sb->journal_block, sb->journal_count, sb->snapshot_block };
+}
+
+/*
+ * Log the metadata changed since the last commit as one transaction, written
+ * after the previous ones with a single sequential write (all locks held).
+ *
+ * Return: -1 if writing to the virtual disk fails, or if memory cannot be
+ * allocated. 0 otherwise.
+ */
+int journal_commit(void)
+{
+	size_t dirty = 0;
+
+	for (int i = 0; i < superblock.FAT_count; i++) {
+
+		dirty += FAT_dirty[i];
+
+	}
+
+	for (size_t i = 0; i < refcount_count; i++) {
+
+		dirty += refcount_dirty[i];
+
+	}
+
+	/* every possible record, rounded up to whole blocks */
+	size_t max = sizeof(struct journal_header) + sizeof(struct journal_record) * (1 + 2048 * dirty) + sizeof(struct journal_super) + (sizeof(struct journal_record) + sizeof(struct file_entry)) * FS_FILE_MAX_COUNT;
+
+	uint8_t *tx = (uint8_t *) calloc((max + BLOCK_SIZE - 1) / BLOCK_SIZE, BLOCK_SIZE);
+
+	if (tx == NULL) {
+
+		return -1;
+
+	}
+
+	size_t length = 0;
+
+	uint8_t *records = tx + sizeof(struct journal_header);
+
+	struct journal_record *record;
+
+	struct journal_super ext, committed_ext;
+
+	journal_super_get(&ext, &superblock);
+
+	journal_super_get(&committed_ext, &journal.superblock);
+
+	if (superblock_dirty && memcmp(&ext, &committed_ext, sizeof(struct journal_super))) {
+
+		record = (struct journal_record *) (records + length);
+
+		*record = (struct journal_record) { JOURNAL_SUPER_EXT, 0, 0 };
+
+		memcpy(record + 1, &ext, sizeof(struct journal_super));
+
+		length += sizeof(struct journal_record) + sizeof(struct journal_super);
+
+	}
+
+	for (size_t i = 0; i < 2048 * (size_t) superblock.FAT_count; i++) {
+
+		if (FAT_dirty[i / 2048] && FAT[i] != journal.FAT[i]) {
+
+			record = (struct journal_record *) (records + length);
+
+			*record = (struct journal_record) { JOURNAL_FAT, i, FAT[i] };
+
+			length += sizeof(struct journal_record);
+
+		}
+	}
+
+	for (int i = 0; root_dirty && i < FS_FILE_MAX_COUNT; i++) {
+
+		if (memcmp(&Root[i], &journal.root[i], sizeof(struct file_entry))) {
+
+			record = (struct journal_record *) (records + length);
+
+			*record = (struct journal_record) { JOURNAL_ROOT, i, 0 };
+
+			memcpy(record + 1, &Root[i], sizeof(struct file_entry));
+
+			length += sizeof(struct journal_record) + sizeof(struct file_entry);
+
+		}
+	}
+
+	for (size_t i = 0; i < 2048 * refcount_count; i++) {
+
+		if (refcount_dirty[i / 2048] && refcount[i] != journal.refcount[i]) {
+
+			record = (struct journal_record *) (records + length);
+
+			*record = (struct journal_record) { JOURNAL_REFCOUNT, i, refcount[i] };
+
+			length += sizeof(struct journal_record);
+
+		}
+	}
+
+	size_t n = (sizeof(struct journal_header) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	int ret = 0;
+
+	if (length == 0) {
+
+		/* nothing changed */
+
+	} else if (n > superblock.journal_count) {
+
+		/* larger than the whole journal */
+		free(tx);
+
+		return journal_reset();
+
+	} else if (journal.head + n > superblock.journal_count && journal_checkpoint()) {
+
+		ret = -1;
+
+	} else {
+
+		struct journal_header *header = (struct journal_header *) tx;
+
+		*header = (struct journal_header) { JOURNAL_MAGIC, journal.seq, length, 0 };
+
+		header->checksum = journal_crc(tx, sizeof(struct journal_header) + length);
+
+		size_t blocks[n];
+
+		const void *bufs[n];
+
+		for (size_t k = 0; k < n; k++) {
+
+			blocks[k] = superblock.data + superblock.journal_block + journal.head + k;
+
+			bufs[k] = tx + k * BLOCK_SIZE;
+
+		}
+
+		ret = block_write_many(blocks, bufs, n);
+
+	}
+
+	free(tx);
+
+	if (ret) {
+
+		return -1;
+
+	}
+
+	if (length > 0) {
+
+		journal.head += n;
+
+		journal.seq++;
+
+	}
+
+	/* the logged metadata becomes the committed one */
+	if (superblock_dirty) {
+
+		memcpy(&journal.superblock, &superblock, sizeof(struct superblock));
+
+		journal.superblock_stale = 1;
+
+	}
+
+	for (int i = 0; i < superblock.FAT_count; i++) {
+
+		if (FAT_dirty[i]) {
+
+			memcpy(journal.FAT + 2048 * i, FAT + 2048 * i, sizeof(uint16_t) * 2048);
+
+			journal.FAT_stale[i] = 1;
+
+		}
+	}
+
+	if (root_dirty) {
+
+		memcpy(journal.root, Root, sizeof(Root));
+
+		journal.root_stale = 1;
+
+	}
+
+	for (size_t i = 0; i < refcount_count; i++) {
+
+		if (refcount_dirty[i]) {
+
+			memcpy(journal.refcount + 2048 * i, refcount + 2048 * i, sizeof(uint16_t) * 2048);
+
+			journal.refcount_stale[i] = 1;
+
+		}
+	}
+
+	superblock_dirty = 0;
+
+	memset(FAT_dirty, 0, superblock.FAT_count);
+
+	root_dirty = 0;
+
+	if (refcount_count > 0) {
+
+		memset(refcount_dirty, 0, refcount_count);
+
+	}
+
+	return 0;
+}
+
+/*
+ * Write back the metadata modified since the last call: logged as a journal
+ * transaction with FS_FEATURE_JOURNAL, in place otherwise (all locks held).
+ *
+ * Return: -1 if writing to the virtual disk fails. 0 otherwise.
+ */
+int metadata_flush(void)
+{
+	if (journal.FAT == NULL) {
+
+		return metadata_write();
+
+	}
+
+	if (journal.rewrite) {
+
+		return journal_reset();
+
+	}
+
+	return journal_commit();
+}
+
+/*
+ * Create an empty journal in a run of free consecutive data blocks, chained
+ * in the FAT like a file (dir_lock and alloc_lock held).
+ *
+ * Return: -1 if no run of free data blocks is long enough, or if memory cannot
+ * be allocated. 0 otherwise.
+ */
+int journal_create(void)
+{
+	size_t count = superblock.total_data_blocks / 8;
+
+	if (count > JOURNAL_BLOCKS) {
+
+		count = JOURNAL_BLOCKS;
+
+	}
+
+	if (count == 0) {
+
+		count = 1;
+
+	}
+
+	size_t run = 0;
+
+	int start = -1;
+
+	for (int i = 0; i < superblock.total_data_blocks && start == -1; i++) {
+
+		run = FAT[i] == 0 ? run + 1 : 0;
+
+		if (run == count) {
+
+			start = i + 1 - count;
+
+		}
+	}
+
+	if (start == -1) {
+
+		return -1;
+
+	}
+
+	for (size_t k = 0; k < count; k++) {
+
+		fat_set(start + k, k + 1 < count ? start + k + 1 : FAT_EOC);
+
+	}
+
+	/* sequence numbers go on from any earlier journal, whose blocks may remain */
+	superblock.journal_block = start;
+
+	superblock.journal_count = count;
+
+	superblock_dirty = 1;
+
+	if (journal_alloc()) {
+
+		for (size_t k = 0; k < count; k++) {
+
+			fat_set(start + k, 0);
+
+		}
+
+		superblock.journal_block = 0;
+
+		superblock.journal_count = 0;
+
+		return -1;
+
+	}
+
+	/* the superblock pointing to the journal is written in place first */
+	journal.rewrite = 1;
+
+	return 0;
+}
+
+/* Free the blocks of the journal, the metadata is written in place again (alloc_lock held) */
+void journal_destroy(void)
+{
+	journal_unstale();
+
+	for (size_t k = 0; k < superblock.journal_count; k++) {
+
+		fat_set(superblock.journal_block + k, 0);
+
+	}
+
+	superblock.journal_block = 0;
+
+	superblock.journal_count = 0;
+
+	superblock_dirty = 1;
+
+	journal_free();
+}
+
+/*
+ * Replay the transactions logged since the last checkpoint on the metadata of
+ * the disk being mounted: the reference counts if @refcounts, the rest of the
+ * metadata otherwise. Replay stops at the first journal block that does not
+ * start the next transaction in sequence, or at a transaction whose checksum
+ * does not match (it was torn by a crash while being logged).
+ *
+ * Return: -1 if the journal does not fit in the disk or if memory cannot be
+ * allocated, the number of transactions replayed otherwise.
+ */
+int journal_replay(int refcounts)
+{
+	size_t count = superblock.journal_count;
+
+	if (count == 0 || superblock.journal_block == 0 || superblock.journal_block + count > superblock.total_data_blocks) {
+
+		return -1;
+
+	}
+
+	uint8_t *tx = (uint8_t *) malloc(count * BLOCK_SIZE);
+
+	if (tx == NULL) {
+
+		return -1;
+
+	}
+
+	struct journal_header *header = (struct journal_header *) tx;
+
+	size_t first = superblock.data + superblock.journal_block;
+
+	size_t pos = 0;
+
+	int replayed = 0;
+
+	while (pos < count && block_read(first + pos, tx) == 0) {
+
+		if (header->magic != JOURNAL_MAGIC || header->seq != superblock.journal_seq + replayed || header->length > (count - pos) * BLOCK_SIZE - sizeof(struct journal_header)) {
+
+			break;
+
+		}
+
+		size_t n = (sizeof(struct journal_header) + header->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		size_t k = 1;
+
+		while (k < n && block_read(first + pos + k, tx + k * BLOCK_SIZE) == 0) {
+
+			k++;
+
+		}
+
+		uint32_t checksum = header->checksum;
+
+		header->checksum = 0;
+
+		if (k < n || journal_crc(tx, sizeof(struct journal_header) + header->length) != checksum) {
+
+			break;
+
+		}
+
+		uint8_t *records = tx + sizeof(struct journal_header);
+
+		for (size_t offset = 0; offset + sizeof(struct journal_record) <= header->length;) {
+
+			struct journal_record *record = (struct journal_record *) (records + offset);
+
+			offset += sizeof(struct journal_record);
+
+			if (record->type == JOURNAL_ROOT) {
+
+				offset += sizeof(struct file_entry);
+
+			} else if (record->type == JOURNAL_SUPER_EXT) {
+
+				offset += sizeof(struct journal_super);
+
+			}
+
+			if (offset > header->length) {
+
+				break;
+
+			}
+
+			if (refcounts) {
+
+				if (record->type == JOURNAL_REFCOUNT && refcount != NULL && record->index < superblock.total_data_blocks) {
+
+					refcount[record->index] = record->value;
+
+					refcount_dirty[record->index / 2048] = 1;
+
+				}
+
+			} else if (record->type == JOURNAL_SUPER && !(record->value & ~FS_FEATURE_ALL)) {
+
+				superblock.features = record->value;
+
+				superblock.refcount_block = record->index;
+
+				superblock_dirty = 1;
+
+			} else if (record->type == JOURNAL_SUPER_EXT) {
+
+				struct journal_super ext;
+
+				memcpy(&ext, record + 1, sizeof(struct journal_super));
+
+				/* a record this version cannot make sense of */
+				if (ext.features & ~FS_FEATURE_ALL) {
+
+					continue;
+
+				}
+
+				superblock.ext_signature = ext.ext_signature;
+
+				superblock.features = ext.features;
+
+				superblock.refcount_block = ext.refcount_block;
+
+				superblock.journal_block = ext.journal_block;
+
+				superblock.journal_count = ext.journal_count;
+
+				superblock.snapshot_block = ext.snapshot_block;
+
+				superblock_dirty = 1;
+
+			} else if (record->type == JOURNAL_FAT && record->index < superblock.total_data_blocks) {
+
+				FAT[record->index] = record->value;
+
+				FAT_dirty[record->index / 2048] = 1;
+
+			} else if (record->type == JOURNAL_ROOT && record->index < FS_FILE_MAX_COUNT) {
+
+				memcpy(&Root[record->index], record + 1, sizeof(struct file_entry));
+
+				root_dirty = 1;
+
+			}
+		}
+
+		pos += n;
+
+		replayed++;
+
+	}
+
+	free(tx);
+
+	/* the counts changed under the ones refcount_load() made */
+	if (refcounts && replayed > 0 && refcount != NULL) {
+
+		size_t shared = 0;
+
+		for (int i = 0; i < superblock.total_data_blocks; i++) {
+
+			shared += refcount[i] != 0;
+
+		}
+
+		__atomic_store_n(&shared_blocks, shared, __ATOMIC_RELAXED);
+
+	}
+
+	return replayed;
+}
+
+/*
+ * Finish mounting a disk with a journal, once @replayed transactions have been
+ * replayed on everything but the reference counts: replay them on the counts,
+ * then write the result in place with a checkpoint.
+ *
+ * Return: -1 if the journal cannot be read back, if memory cannot be
+ * allocated, or if the checkpoint fails. 0 otherwise.
+ */
+int journal_load(int replayed)
+{
+	if (replayed > 0 && journal_replay(1) != replayed) {
+
+		return -1;
+
+	}
+
+	if (journal_alloc()) {
+
+		return -1;
+
+	}
+
+	if (replayed == 0) {
+
+		return 0;
+
+	}
+
+	/* the replayed metadata is committed, and not on disk yet */
+	journal.superblock_stale = superblock_dirty;
+
+	memcpy(journal.FAT_stale, FAT_dirty, superblock.FAT_count);
+
+	journal.root_stale = root_dirty;
+
+	if (refcount_count > 0) {
+
+		memcpy(journal.refcount_stale, refcount_dirty, refcount_count);
+
+	}
+
+	superblock_dirty = 0;
+
+	memset(FAT_dirty, 0, superblock.FAT_count);
+
+	root_dirty = 0;
+
+	if (refcount_count > 0) {
+
+		memset(refcount_dirty, 0, refcount_count);
+
+	}
+
+	journal.seq += replayed;
+
+	if (journal_checkpoint()) {
+
+		journal_free();
+
+		return -1;
+
+	}
+
+	return 0;
+}
+
+/*
+ * Give root entry @slot a chain whose blocks up to block number @upto of the
+ * chain are referenced by this file only, so that they can be modified. Since a
+ * block can only have one successor, every block from the first shared one to
+ * block @upto is copied; the rest of the chain stays shared, now also
+ * referenced by the last copy (dir_lock and alloc_lock held). If @shared is not
+ * NULL, it is set to 0 when no block of the whole chain is shared anymore, to 1
+ * when blocks past @upto can still be.
+ *
+ * Return: -1 if there are not enough free data blocks or memory for the
+ * copies, or if a block cannot be copied (the copies already made stay in the
+ * chain, which is shared from the block that failed on). 0 otherwise.
+ */
+int chain_unshare(int slot, size_t upto, int *shared)
+{
+	uint16_t prev = FAT_EOC;
+
+	uint16_t block = Root[slot].index;
+
+	size_t i = 0;
+
+	/* private part of the chain */
+	while (i <= upto && block != FAT_EOC && !refcount_shared(block)) {
+
+		prev = block;
+
+		block = FAT[block];
+
+		i++;
+
+	}
+
+	if (i > upto || block == FAT_EOC) {
+
+		if (shared != NULL) {
+
+			*shared = block != FAT_EOC;
+
+		}
+
+		return 0;
+
+	}
+
+	/* copies needed, bounded by the end of the chain */
+	size_t needed = 0;
+
+	for (uint16_t b = block; needed <= upto - i && b != FAT_EOC; b = FAT[b]) {
+
+		needed++;
+
+	}
+
+	uint8_t *buffer = pool_get(buffer_pool);
+
+	if (buffer == NULL || free_blocks(needed) < needed) {
+
+		pool_put(buffer_pool, buffer);
+
+		return -1;
+
+	}
+
+	int ret = 0;
+
+	/* the reference of this file moves to the first copy */
+	refcount_drop(block);
+
+	for (; i <= upto && block != FAT_EOC; i++) {
+
+		uint16_t copy = find_first_fit();
+
+		/* the copy would not hold the data, the file keeps sharing from @block on (the copy is not allocated yet) */
+		if (block_read(superblock.data + block, buffer) || cache_write_block(superblock.data + copy, buffer)) {
+
+			ret = -1;
+
+			break;
+
+		}
+
+		fat_set(copy, FAT_EOC);
+
+		/* the data blocks of a copied map block gain a reference */
+		if (file_mapped(slot)) {
+
+			uint16_t *entries = (uint16_t *) buffer;
+
+			for (int e = 0; e < MAP_ENTRIES; e++) {
+
+				if (entries[e] != 0) {
+
+					refcount_inc(entries[e]);
+
+				}
+			}
+		}
+
+		if (prev == FAT_EOC) {
+
+			Root[slot].index = copy;
+
+			root_dirty = 1;
+
+			/* keep the open file's copy of the first block in sync */
+			if (files[slot] != NULL) {
+
+				files[slot]->index = copy;
+
+			}
+
+		} else {
+
+			fat_set(prev, copy);
+
+		}
+
+		prev = copy;
+
+		block = FAT[block];
+
+	}
+
+	pool_put(buffer_pool, buffer);
+
+	if (block != FAT_EOC) {
+
+		/* nothing copied, the root entry still points to @block */
+		if (prev != FAT_EOC) {
+
+			fat_set(prev, block);
+
+		}
+
+		refcount_inc(block);
+
+	}
+
+	if (shared != NULL) {
+
+		*shared = block != FAT_EOC;
+
+	}
+
+	return ret;
+}
+
+/*
+ * Move root entry @slot to the mapped layout, so that it can be written past
+ * its end of file, and enable FS_FEATURE_SPARSE on the first conversion. The
+ * data blocks keep their place, the chain linking them is replaced by map
+ * blocks listing them (dir_lock and alloc_lock held).
+ *
+ * Return: -1 if the map blocks cannot be allocated or written, the file then
+ * keeps its chain. 0 otherwise.
+ */
+int map_convert(int slot)
+{
+	size_t blocks = (Root[slot].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	size_t maps = (blocks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+
+	/* the links of the chain are about to be rewritten */
+	if (blocks > 0 && chain_unshare(slot, blocks - 1, NULL)) {
+
+		return -1;
+
+	}
+
+	uint8_t *buffer = pool_get(buffer_pool);
+
+	if (buffer == NULL || free_blocks(maps) < maps) {
+
+		pool_put(buffer_pool, buffer);
+
+		return -1;
+
+	}
+
+	uint16_t *entries = (uint16_t *) buffer;
+
+	uint16_t block = Root[slot].index;
+
+	uint16_t head = FAT_EOC;
+
+	uint16_t prev = FAT_EOC;
+
+	int ret = 0;
+
+	/* the map is written in full before the chain is unlinked */
+	for (size_t m = 0; m < maps && ret == 0; m++) {
+
+		memset(buffer, 0, BLOCK_SIZE);
+
+		for (int e = 0; e < MAP_ENTRIES && block != FAT_EOC; e++) {
+
+			entries[e] = block;
+
+			block = FAT[block];
+
+		}
+
+		uint16_t map = find_first_fit();
+
+		fat_set(map, FAT_EOC);
+
+		if (prev == FAT_EOC) {
+
+			head = map;
+
+		} else {
+
+			fat_set(prev, map);
+
+		}
+
+		prev = map;
+
+		ret = cache_write_block(superblock.data + map, buffer);
+
+	}
+
+	pool_put(buffer_pool, buffer);
+
+	/* the map blocks go, the file keeps its chain */
+	if (ret) {
+
+		for (block = head; block != FAT_EOC;) {
+
+			uint16_t next = FAT[block];
+
+			fat_set(block, 0);
+
+			block = next;
+
+		}
+
+		return -1;
+
+	}
+
+	/* the data blocks are only listed by the map now */
+	for (block = Root[slot].index; block != FAT_EOC;) {
+
+		uint16_t next = FAT[block];
+
+		fat_set(block, FAT_EOC);
+
+		block = next;
+
+	}
+
+	Root[slot].index = head;
+
+	Root[slot].flags |= FILE_MAPPED;
+
+	root_dirty = 1;
+
+	if (files[slot] != NULL) {
+
+		files[slot]->index = head;
+
+	}
+
+	if (!(superblock.features & FS_FEATURE_SPARSE)) {
+
+		memcpy(&superblock.ext_signature, EXT_SIGNATURE, 4);
+
+		superblock.features |= FS_FEATURE_SPARSE;
+
+		superblock_dirty = 1;
+
+	}
+
+	return 0;
+}
+
+/* Count the root entries whose packed tail lives in data block @block */
+int tail_block_users(uint16_t block)
+{
+	int users = 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		if (*(char *) &Root[i].filename != '\0' && Root[i].tail_block == block) {
+
+			users++;
+
+		}
+	}
+
+	return users;
+}
+
+/*
+ * Find room for a @len bytes tail in the existing pack blocks. Fragments are
+ * only described by the root entries pointing to them, so the free gaps of a
+ * pack block are found by sorting the fragments of that block by offset.
+ */
+int tail_fit(size_t len, uint16_t *block, uint16_t *offset)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		uint16_t candidate = Root[i].tail_block;
+
+		/* pack blocks of a snapshot do not change anymore */
+		if (*(char *) &Root[i].filename == '\0' || candidate == 0 || refcount_shared(candidate)) {
+
+			continue;
+
+		}
+
+		uint16_t starts[FS_FILE_MAX_COUNT];
+
+		uint16_t ends[FS_FILE_MAX_COUNT];
+
+		int n = 0;
+
+		int seen = 0;
+
+		for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
+
+			if (*(char *) &Root[j].filename == '\0' || Root[j].tail_block != candidate) {
+
+				continue;
+
+			}
+
+			/* each pack block is only examined from its first user */
+			if (j < i) {
+
+				seen = 1;
+				break;
+
+			}
+
+			/* insertion sort by offset */
+			int k = n++;
+
+			while (k > 0 && starts[k - 1] > Root[j].tail_offset) {
+
+				starts[k] = starts[k - 1];
+
+				ends[k] = ends[k - 1];
+
+				k--;
+
+			}
+
+			starts[k] = Root[j].tail_offset;
+
+			ends[k] = Root[j].tail_offset + Root[j].size % BLOCK_SIZE;
+
+		}
+
+		if (seen) {
+
+			continue;
+
+		}
+
+		size_t gap_start = 0;
+
+		for (int k = 0; k <= n; k++) {
+
+			size_t gap_end = k < n ? starts[k] : BLOCK_SIZE;
+
+			if (gap_end >= gap_start + len) {
+
+				*block = candidate;
+
+				*offset = gap_start;
+
+				return 0;
+
+			}
+
+			if (k < n && ends[k] > gap_start) {
+
+				gap_start = ends[k];
+
+			}
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Move the last, partially filled data block of root entry @slot into a shared
+ * pack block. If no pack block has enough room left, or if the tail cannot be
+ * copied there, the last block itself is detached from the chain and becomes a
+ * new pack block.
+ */
+void tail_pack(int slot)
+{
+	size_t len = Root[slot].size % BLOCK_SIZE;
+
+	if (Root[slot].tail_block != 0 || len == 0 || len > TAIL_PACK_MAX || file_mapped(slot)) {
+
+		return;
+
+	}
+
+	uint16_t prev = FAT_EOC;
+
+	uint16_t last = Root[slot].index;
+
+	for (size_t i = 0; i < Root[slot].size / BLOCK_SIZE; i++) {
+
+		/* the chain is shared with another file, leave it as is */
+		if (refcount_shared(last)) {
+
+			return;
+
+		}
+
+		prev = last;
+
+		last = FAT[last];
+
+	}
+
+	if (refcount_shared(last)) {
+
+		return;
+
+	}
+
+	uint16_t block;
+
+	uint16_t offset;
+
+	uint8_t *buffer = NULL;
+
+	/* no room in a pack block, or no buffer to move the tail there */
+	if (tail_fit(len, &block, &offset) || (buffer = pool_get(buffer_pool)) == NULL) {
+
+		/* data already sits at offset 0 of the detached block */
+		block = last;
+
+		offset = 0;
+
+	} else {
+
+		int ret = cache_read(superblock.data + last, buffer, 0, len);
+
+		if (ret == 0) {
+
+			ret = cache_write(superblock.data + block, buffer, offset, len);
+
+		}
+
+		pool_put(buffer_pool, buffer);
+
+		/* the last block stays the only copy of the tail until it is moved */
+		if (ret) {
+
+			block = last;
+
+			offset = 0;
+
+		} else {
+
+			fat_set(last, 0);
+
+		}
+	}
+
+	if (prev == FAT_EOC) {
+
+		Root[slot].index = FAT_EOC;
+
+	} else {
+
+		fat_set(prev, FAT_EOC);
+
+	}
+
+	Root[slot].tail_block = block;
+
+	Root[slot].tail_offset = offset;
+
+	root_dirty = 1;
+}
+
+/* Drop the packed tail reference of root entry @slot */
+void tail_release(int slot)
+{
+	uint16_t block = Root[slot].tail_block;
+
+	Root[slot].tail_block = 0;
+
+	Root[slot].tail_offset = 0;
+
+	root_dirty = 1;
+
+	/* last fragment gone, the pack block is free again unless in a snapshot */
+	if (block != 0 && tail_block_users(block) == 0 && !refcount_drop(block)) {
+
+		fat_set(block, 0);
+
+	}
+}
+
+/*
+ * Move the packed tail of root entry @slot back to a data block appended to
+ * the file's chain, so that the file can be modified in place.
+ *
+ * Return: -1 if there is no free data block for the tail, or if the tail cannot
+ * be copied there, in which case it stays packed. 0 otherwise.
+ */
+int tail_unpack(int slot)
+{
+	uint16_t pack = Root[slot].tail_block;
+
+	uint16_t offset = Root[slot].tail_offset;
+
+	size_t len = Root[slot].size % BLOCK_SIZE;
+
+	uint16_t block = pack;
+
+	/* the last block of the chain gets a successor, it must not be shared */
+	if (Root[slot].size >= BLOCK_SIZE && chain_unshare(slot, Root[slot].size / BLOCK_SIZE - 1, NULL)) {
+
+		return -1;
+
+	}
+
+	/* other fragments live in the pack block, the tail needs its own block */
+	if (tail_block_users(pack) > 1 || refcount_shared(pack)) {
+
+		int available = find_first_fit();
+
+		if (available == -1) {
+
+			return -1;
+
+		}
+
+		block = available;
+
+	}
+
+	if (block != pack || offset != 0) {
+
+		uint8_t *buffer = pool_get(buffer_pool);
+
+		if (buffer == NULL) {
+
+			return -1;
+
+		}
+
+		int ret = cache_read(superblock.data + pack, buffer, offset, len);
+
+		if (ret == 0) {
+
+			memset(buffer + len, 0, BLOCK_SIZE - len);
+
+			ret = cache_write_block(superblock.data + block, buffer);
+
+		}
+
+		pool_put(buffer_pool, buffer);
+
+		/* the chain only points to the new block once the tail is there */
+		if (ret) {
+
+			return -1;
+
+		}
+	}
+
+	/* last live fragment of a pack block kept for snapshots */
+	if (block != pack && tail_block_users(pack) == 1) {
+
+		refcount_drop(pack);
+
+	}
+
+	Root[slot].tail_block = 0;
+
+	Root[slot].tail_offset = 0;
+
+	fat_set(block, FAT_EOC);
+
+	if (Root[slot].index == FAT_EOC) {
+
+		Root[slot].index = block;
+
+		/* keep the open file's copy of the first block in sync */
+		if (files[slot] != NULL) {
+
+			files[slot]->index = block;
+
+		}
+
+	} else {
+
+		uint16_t last = chain_seek(Root[slot].index, Root[slot].size - len - 1);
+
+		fat_set(last, block);
+
+	}
+
+	root_dirty = 1;
+
+	return 0;
+}
+
+/*
+ * Drop a reference on the chain starting at @block, the map blocks of a
+ * mapped file if @mapped, and free the blocks no longer referenced
+ * (alloc_lock held).
+ */
+void chain_release(uint16_t block, int mapped)
+{
+	while (block != FAT_EOC && block != 0 && block < superblock.total_data_blocks) {
+
+		/* the rest of the chain is still used by another file */
+		if (refcount_drop(block)) {
+
+			break;
+
+		}
+
+		/* data blocks of a map block, unless shared with another map */
+		for (int e = 0; mapped && e < MAP_ENTRIES; e++) {
+
+			uint16_t data = 0;
+
+			cache_read(superblock.data + block, &data, e * sizeof(uint16_t), sizeof(uint16_t));
+
+			if (data != 0 && data < superblock.total_data_blocks && !refcount_drop(data)) {
+
+				fat_set(data, 0);
+
+			}
+		}
+
+		uint16_t next = FAT[block];
+
+		fat_set(block, 0);
+
+		block = next;
+
+	}
+}
+
+/* Release the data blocks of root entry @slot back to the FAT and clear it */
+void root_release(int slot)
+{
+	if (Root[slot].tail_block != 0) {
+
+		tail_release(slot);
+
+	}
+
+	chain_release(Root[slot].index, file_mapped(slot));
+
+	memset(&Root[slot], 0, sizeof(struct file_entry));
+
+	root_dirty = 1;
+}
+
+/* Number of snapshots in the snapshot table (alloc_lock held) */
+int snapshot_count(void)
+{
+	int count = 0;
+
+	for (int i = 0; snapshot_table != NULL && i < FS_SNAPSHOT_MAX; i++) {
+
+		if (snapshot_table[i] != 0) {
+
+			count++;
+
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Drop the references held by the frozen root directory in data block @block,
+ * then free the block itself (alloc_lock held).
+ */
+void snapshot_release(uint16_t block)
+{
+	struct file_entry entries[FS_FILE_MAX_COUNT];
+
+	cache_read(superblock.data + block, entries, 0, sizeof(entries));
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		if (*(char *) &entries[i].filename == '\0') {
+
+			continue;
+
+		}
+
+		uint16_t tail = entries[i].tail_block;
+
+		if (tail != 0 && tail < superblock.total_data_blocks && !refcount_drop(tail)) {
+
+			fat_set(tail, 0);
+
+		}
+
+		chain_release(entries[i].index, entries[i].flags & FILE_MAPPED);
+
+	}
+
+	fat_set(block, 0);
+}
+
+/*
+ * Read the snapshot table of the disk being mounted.
+ *
+ * Return: -1 if the table cannot be read. 0 otherwise.
+ */
+int snapshot_load(void)
+{
+	uint16_t block = superblock.snapshot_block;
+
+	/* no snapshot taken yet */
+	if (block == 0) {
+
+		return 0;
+
+	}
+
+	snapshot_table = (uint16_t *) malloc(BLOCK_SIZE);
+
+	if (snapshot_table == NULL || block >= superblock.total_data_blocks || block_read(superblock.data + block, snapshot_table)) {
+
+		free(snapshot_table);
+
+		snapshot_table = NULL;
+
+		return -1;
+
+	}
+
+	return 0;
+}
+
+/* Free the block of the (empty) snapshot table (alloc_lock held) */
+void snapshot_destroy(void)
+{
+	fat_set(superblock.snapshot_block, 0);
+
+	superblock.snapshot_block = 0;
+
+	superblock_dirty = 1;
+
+	free(snapshot_table);
+
+	snapshot_table = NULL;
+}
+
+/*
+ * Drop a reference on open file @file (dir_lock held). With the last one,
+ * @last is set and the file is closed, but it stays to be freed by file_free()
+ * once dir_lock is released.
+ *
+ * Return: -1 if the bytes appended to the file cannot be written, which loses
+ * them. 0 otherwise.
+ */
+int file_put(struct ECS150file *file, int *last)
+{
+	*last = --file->refs == 0;
+
+	if (!*last) {
+
+		return 0;
+
+	}
+
+	files[file->slot] = NULL;
+
+	int ret = append_drop(file);
+
+	/* no one is left to write them later */
+	if (ret) {
+
+		pool_put(buffer_pool, file->append_data);
+
+	}
+
+	if ((superblock.features & FS_FEATURE_TAILPACK) && !readonly) {
+
+		pthread_mutex_lock(&alloc_lock);
+
+		tail_pack(file->slot);
+
+		pthread_mutex_unlock(&alloc_lock);
+
+	}
+
+	return ret;
+}
+
+/* Free open file @file, closed by file_put() (dir_lock not held) */
+void file_free(struct ECS150file *file)
+{
+	/* no reference is left, but a caller may not have released the lock yet */
+	pthread_rwlock_wrlock(&file->lock);
+
+	pthread_rwlock_unlock(&file->lock);
+
+	pthread_rwlock_destroy(&file->lock);
+
+	pthread_mutex_destroy(&file->append_lock);
+
+	pool_put(file_pool, file);
+}
+
+/* Drop a reference on open file @file, such as the one taken by fd_entry() (dir_lock and file lock not held) */
+void fd_put(struct ECS150file *file)
+{
+	int last;
+
+	pthread_mutex_lock(&dir_lock);
+
+	file_put(file, &last);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	if (last) {
+
+		file_free(file);
+
+	}
+}
+
+int fs_format(const char *diskname, size_t data_blocks, const struct fs_format_options *options)
+{
+	/* the disk of the mounted file system is the only one open */
+	if (mounted) {
+
+		return -1;
+
+	}
+
+	/* invalid geometry */
+	if (data_blocks == 0 || data_blocks > FS_DATA_BLOCK_MAX) {
+
+		return -1;
+
+	}
+
+	unsigned int features = options != NULL ? options->features : 0;
+
+	/* unknown features */
+	if (features & ~FS_FEATURE_ALL) {
+
+		return -1;
+
+	}
+
+	struct superblock *sb = (struct superblock *) calloc(1, sizeof(struct superblock));
+
+	uint16_t *fat = (uint16_t *) calloc(2048, sizeof(uint16_t));
+
+	if (sb == NULL || fat == NULL) {
+
+		free(sb);
+
+		free(fat);
+
+		return -1;
+
+	}
+
+	memcpy(&sb->signature, "ECS150FS", 8);
+
+	sb->FAT_count = (data_blocks + 2047) / 2048;
+
+	sb->root = sb->FAT_count + 1;
+
+	sb->data = sb->root + 1;
+
+	sb->total_data_blocks = data_blocks;
+
+	sb->total_block_disk = sb->data + data_blocks;
+
+	/* the first data block is never allocated, its entry ends no chain */
+	fat[0] = FAT_EOC;
+
+	/* the other blocks are holes of the new disk file, read back as zeros */
+	size_t blocks[2] = { 0, 1 };
+
+	const void *bufs[2] = { sb, fat };
+
+	int ret = -1;
+
+	if (block_disk_create(diskname, sb->total_block_disk) == 0 && block_disk_open(diskname) == 0) {
+
+		ret = block_write_many(blocks, bufs, 2);
+
+		if (block_disk_close()) {
+
+			ret = -1;
+
+		}
+	}
+
+	free(sb);
+
+	free(fat);
+
+	if (ret == 0 && features != 0) {
+
+		if (fs_mount(diskname)) {
+
+			return -1;
+
+		}
+
+		ret = fs_set_features(features);
+
+		if (fs_umount()) {
+
+			ret = -1;
+
+		}
+	}
+
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	if (block_disk_open(diskname)) {
+
+		return -1;
+
+	}
+
+	block_read(0, &superblock);
+
+	char sig[8] = {'E','C','S','1','5','0','F','S'};
+
+	if (memcmp(&superblock.signature, &sig, 8)) {
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	/* images made without the extension carry no optional feature */
+	if (memcmp(&superblock.ext_signature, EXT_SIGNATURE, 4)) {
+
+		superblock.features = 0;
+
+		superblock.refcount_block = 0;
+
+		superblock.journal_block = 0;
+
+		superblock.journal_count = 0;
+
+		superblock.journal_seq = 0;
+
+		superblock.snapshot_block = 0;
+
+	}
+
+	/* unknown features change the layout in ways this code cannot handle */
+	if (superblock.features & ~FS_FEATURE_ALL) {
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	FAT = (uint16_t *) malloc(sizeof(uint16_t) * 2048 * superblock.FAT_count);
+
+	FAT_dirty = (uint8_t *) calloc(superblock.FAT_count, sizeof(uint8_t));
+
+	/* no memory for the FAT */
+	if (FAT == NULL || FAT_dirty == NULL) {
+
+		free(FAT);
+
+		free(FAT_dirty);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	superblock_dirty = 0;
+
+	root_dirty = 0;
+
+	uint16_t *tmp_fat = FAT;
+
+	for (int i = 0; i < superblock.FAT_count; i++) {
+
+		block_read(i + 1, tmp_fat);
+
+		tmp_fat = tmp_fat + 2048;
+
+	}
+
+	block_read(superblock.root, &Root[0]);
+
+	/* metadata logged since the last checkpoint of the journal */
+	int replayed = (superblock.features & FS_FEATURE_JOURNAL) ? journal_replay(0) : 0;
+
+	/* shared blocks cannot be told apart without the reference counts */
+	if (replayed < 0 || ((superblock.features & FS_FEATURE_REFLINK) && refcount_load())) {
+
+		free(FAT);
+
+		free(FAT_dirty);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	if ((superblock.features & FS_FEATURE_JOURNAL) && journal_load(replayed)) {
+
+		refcount_free();
+
+		free(FAT);
+
+		free(FAT_dirty);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	if ((superblock.features & FS_FEATURE_SNAPSHOT) && snapshot_load()) {
+
+		journal_free();
+
+		refcount_free();
+
+		free(FAT);
+
+		free(FAT_dirty);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	cache = cache_create();
+
+	/* no memory for the block cache */
+	if (cache == NULL) {
+
+		free(snapshot_table);
+
+		snapshot_table = NULL;
+
+		journal_free();
+
+		refcount_free();
+
+		free(FAT);
+
+		free(FAT_dirty);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	buffer_pool = pool_create(BLOCK_SIZE, BUFFER_SLAB_OBJECTS);
+
+	file_pool = pool_create(sizeof(struct ECS150file), FILE_SLAB_OBJECTS);
+
+	/* no memory for the pools */
+	if (buffer_pool == NULL || file_pool == NULL) {
+
+		pool_destroy(buffer_pool);
+
+		pool_destroy(file_pool);
+
+		buffer_pool = NULL;
+
+		file_pool = NULL;
+
+		cache_destroy(cache);
+
+		cache = NULL;
+
+		free(snapshot_table);
+
+		snapshot_table = NULL;
+
+		journal_free();
+
+		refcount_free();
+
+		free(FAT);
+
+		free(FAT_dirty);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	fd_count = 0;
+
+	mounted = 1;
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* asynchronous requests still running or not reaped, otherwise no new ones */
+	if (async_quiesce()) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	pthread_mutex_lock(&alloc_lock);
+
+	/* files still open, or metadata cannot be written back (mounted snapshots write nothing) */
+	if (fd_count > 0 || (!readonly && (metadata_flush() || (journal.FAT != NULL && journal_checkpoint()))) || block_disk_close()) {
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		async_resume();
+
+		return -1;
+
+	}
+
+	free(FAT);
+
+	free(FAT_dirty);
+
+	cache_destroy(cache);
+
+	cache = NULL;
+
+	refcount_free();
+
+	journal_free();
+
+	free(snapshot_table);
+
+	snapshot_table = NULL;
+
+	pool_destroy(buffer_pool);
+
+	pool_destroy(file_pool);
+
+	for (int i = 0; i < FD_CHUNK_COUNT && fds[i] != NULL; i++) {
+
+		for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+
+			pthread_mutex_destroy(&fds[i][j].offset_lock);
+
+		}
+
+		free(fds[i]);
+
+		fds[i] = NULL;
+
+	}
+
+	mounted = 0;
+
+	readonly = 0;
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	/* the unmount went ahead, the idle workers can go */
+	async_stop();
+
+	return 0;
+}
+
+int fs_sync(void)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing to write back */
+	if (readonly) {
+
+		return 0;
+
+	}
+
+	int ret = 0;
+
+	pthread_mutex_lock(&dir_lock);
+
+	/* appended bytes that cannot be written fail the call, the rest goes on */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		if (files[i] != NULL && append_flush(files[i])) {
+
+			ret = -1;
+
+		}
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+
+	if (metadata_flush()) {
+
+		ret = -1;
+
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return ret;
+}
+
+int fs_fsync(int fd)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	struct ECS150fd *entry;
+
+	struct ECS150file *file = fd_entry(fd, &entry);
+
+	/* fd not open */
+	if (file == NULL) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing to write back */
+	if (readonly) {
+
+		fd_put(file);
+
+		return 0;
+
+	}
+
+	/* appended bytes still in memory go to the disk first */
+	pthread_rwlock_rdlock(&file->lock);
+
+	int ret = append_flush(file);
+
+	pthread_rwlock_unlock(&file->lock);
+
+	fd_put(file);
+
+	if (ret) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&sync_lock);
+
+	uint64_t ticket = ++sync_ticket;
+
+	while (sync_done < ticket && ret == 0) {
+
+		/* a commit is running, it may have started before this call */
+		if (sync_running) {
+
+			pthread_cond_wait(&sync_cond, &sync_lock);
+
+			continue;
+
+		}
+
+		/* lead the next commit, for every ticket taken so far */
+		uint64_t upto = sync_ticket;
+
+		sync_running = 1;
+
+		pthread_mutex_unlock(&sync_lock);
+
+		pthread_mutex_lock(&dir_lock);
+
+		pthread_mutex_lock(&alloc_lock);
+
+		ret = metadata_flush();
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		if (ret == 0) {
+
+			ret = block_disk_sync();
+
+		}
+
+		pthread_mutex_lock(&sync_lock);
+
+		/* on failure, the waiting calls retry with a commit of their own */
+		if (ret == 0) {
+
+			sync_done = upto;
+
+		}
+
+		sync_running = 0;
+
+		pthread_cond_broadcast(&sync_cond);
+
+	}
+
+	pthread_mutex_unlock(&sync_lock);
+
+	return ret;
+}
+
+int fs_set_features(unsigned int features)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	/* unknown features */
+	if (features & ~FS_FEATURE_ALL) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	pthread_mutex_lock(&alloc_lock);
+
+	int ret = 0;
+
+	unsigned int disabled = superblock.features & ~features;
+
+	/* every refusal is checked before anything is changed */
+	if ((disabled & FS_FEATURE_TAILPACK) && fd_count > 0) {
+
+		/* packed tails have to go back to regular blocks with no file open */
+		ret = -1;
+
+	}
+
+	/* files with holes cannot be read without their map, snapshots may have some */
+	if (ret == 0 && (disabled & FS_FEATURE_SPARSE)) {
+
+		ret = snapshot_count() > 0 ? -1 : 0;
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT && ret == 0; i++) {
+
+			if (*(char *) &Root[i].filename != '\0' && file_mapped(i)) {
+
+				ret = -1;
+
+			}
+		}
+	}
+
+	/* the snapshot table can only go while no snapshot is left */
+	if (ret == 0 && !(features & FS_FEATURE_SNAPSHOT) && snapshot_table != NULL && snapshot_count() > 0) {
+
+		ret = -1;
+
+	}
+
+	/* the reference counts can only go while no block is shared */
+	if (ret == 0 && !(features & FS_FEATURE_REFLINK) && refcount != NULL && shared_blocks > 0) {
+
+		ret = -1;
+
+	}
+
+	/* an unpacked tail is valid either way, so a failure midway needs no undo */
+	if (ret == 0 && !(features & FS_FEATURE_TAILPACK)) {
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT && ret == 0; i++) {
+
+			if (*(char *) &Root[i].filename != '\0' && Root[i].tail_block != 0) {
+
+				ret = tail_unpack(i);
+
+			}
+		}
+	}
+
+	int refcount_created = 0;
+
+	if (ret == 0 && (features & FS_FEATURE_REFLINK) && refcount == NULL) {
+
+		ret = refcount_create();
+
+		refcount_created = ret == 0;
+
+	}
+
+	if (ret == 0 && (features & FS_FEATURE_JOURNAL) && journal.FAT == NULL) {
+
+		ret = journal_create();
+
+		/* undo the table created above, the call changes nothing on failure */
+		if (ret != 0 && refcount_created) {
+
+			refcount_destroy();
+
+		}
+	}
+
+	/* nothing can fail past this point */
+	if (ret == 0 && !(features & FS_FEATURE_JOURNAL) && journal.FAT != NULL) {
+
+		journal_destroy();
+
+	}
+
+	if (ret == 0 && !(features & FS_FEATURE_SNAPSHOT) && snapshot_table != NULL) {
+
+		snapshot_destroy();
+
+	}
+
+	if (ret == 0 && !(features & FS_FEATURE_REFLINK) && refcount != NULL) {
+
+		refcount_destroy();
+
+	}
+
+	if (ret == 0) {
+
+		memcpy(&superblock.ext_signature, EXT_SIGNATURE, 4);
+
+		superblock.features = features;
+
+		superblock_dirty = 1;
+
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return ret;
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	if (st == NULL) {
+
+		return -1;
+
+	}
+
+	st->total_blocks = superblock.total_block_disk;
+	st->fat_blocks = superblock.FAT_count;
+	st->root_block = superblock.root;
+	st->data_start = superblock.data;
+	st->data_blocks = superblock.total_data_blocks;
+	st->free_data_blocks = 0;
+	st->max_files = FS_FILE_MAX_COUNT;
+	st->free_files = 0;
+	st->features = superblock.features;
+	st->shared_data_blocks = shared_blocks;
+	st->journal_blocks = superblock.journal_count;
+
+	pthread_mutex_lock(&dir_lock);
+
+	pthread_mutex_lock(&alloc_lock);
+
+	for (int i = 0; i < superblock.total_data_blocks; i++) {
+
+		if (FAT[i] == 0) {
+
+			st->free_data_blocks++;
+
+		}
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		if (*(char *) &Root[i].filename == '\0') {
+
+			st->free_files++;
+
+		}
+	}
+
+	st->snapshots = snapshot_count();
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return 0;
+}
+
+/* Copy the counters of @pool to @st */
+void poolstat_fill(struct pool *pool, struct fs_poolstat *st)
+{
+	struct pool_stat ps;
+
+	pool_stat(pool, &ps);
+
+	st->object_size = ps.object_size;
+	st->allocated = ps.allocated;
+	st->in_use = ps.in_use;
+	st->high_water = ps.high_water;
+}
+
+int fs_poolstat(struct fs_poolstat *buffers, struct fs_poolstat *files)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	if (buffers == NULL || files == NULL) {
+
+		return -1;
+
+	}
+
+	poolstat_fill(buffer_pool, buffers);
+
+	poolstat_fill(file_pool, files);
+
+	return 0;
+}
+
+int fs_iostat(struct fs_iostat *st)
+{
+	struct block_stat bs;
+
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	if (st == NULL || block_disk_stat(&bs)) {
+
+		return -1;
+
+	}
+
+	st->block_reads = bs.reads;
+	st->block_writes = bs.writes;
+	st->syncs = bs.syncs;
+
+	return 0;
+}
+
+int fs_info(void)
+{
+	struct fs_statfs st;
+
+	/* no disk mounted */
+	if (fs_statfs(&st)) {
+
+		return -1;
+
+	}
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%zu\n", st.total_blocks);
+	printf("fat_blk_count=%zu\n", st.fat_blocks);
+	printf("rdir_blk=%zu\n", st.root_block);
+	printf("data_blk=%zu\n", st.data_start);
+	printf("data_blk_count=%zu\n", st.data_blocks);
+	printf("fat_free_ratio=%zu/%zu\n", st.free_data_blocks, st.data_blocks);
+	printf("rdir_free_ratio=%zu/%zu\n", st.free_files, st.max_files);
+
+	return 0;
+}
+
+int fs_create(const char *filename)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	/* invalid filename, or not null terminated */
+	if (!filename_valid(filename)) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	/* existing filename */
+	if (root_find(filename) != -1) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	int first_root_empty_index = -1;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		uint8_t empty = '\0';
+
+		if(!memcmp(&Root[i].filename, &empty, 1)) {
+
+				first_root_empty_index = i;
+				break;
+
+		}
+	}
+
+	/* no more space */
+	if (first_root_empty_index == -1) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	/* slots freed by other implementations may hold stale fields */
+	memset(&Root[first_root_empty_index], 0, sizeof(struct file_entry));
+
+	memcpy(&Root[first_root_empty_index].filename, filename, strlen(filename) + 1);
+
+	Root[first_root_empty_index].size = 0;
+
+	Root[first_root_empty_index].index = FAT_EOC;
+
+	root_dirty = 1;
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return 0;
+}
+
+int fs_delete(const char *filename)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	/* invalid filename, or not null terminated */
+	if (!filename_valid(filename)) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	int root_file_index = root_find(filename);
+
+	/* no file found, or currently open */
+	if (root_file_index == -1 || files[root_file_index] != NULL) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+
+	root_release(root_file_index);
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return 0;
+}
+
+/*
+ * Create file @filename sharing the data of root entry @slot (dir_lock held).
+ * Return -1 if the file cannot be created, 0 otherwise.
+ */
+int root_copy(int slot, const char *filename)
+{
+	/* existing filename */
+	if (root_find(filename) != -1) {
+
+		return -1;
+
+	}
+
+	int copy = -1;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT && copy == -1; i++) {
+
+		if (*(char *) &Root[i].filename == '\0') {
+
+			copy = i;
+
+		}
+	}
+
+	/* no more space */
+	if (copy == -1) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+
+	/* first copy on this disk, start counting references */
+	if (reflink_enable()) {
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		return -1;
+
+	}
+
+	/* the whole chain is reached through its first block */
+	if (Root[slot].index != FAT_EOC) {
+
+		refcount_inc(Root[slot].index);
+
+		/* writes through the open file copy its blocks from now on */
+		if (files[slot] != NULL) {
+
+			files[slot]->shared = 1;
+
+		}
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	/* a packed tail is shared as is, its fragment is counted per root entry */
+	memset(&Root[copy], 0, sizeof(struct file_entry));
+
+	memcpy(&Root[copy].filename, filename, strlen(filename) + 1);
+
+	Root[copy].size = Root[slot].size;
+
+	Root[copy].index = Root[slot].index;
+
+	Root[copy].tail_block = Root[slot].tail_block;
+
+	Root[copy].tail_offset = Root[slot].tail_offset;
+
+	Root[copy].flags = Root[slot].flags;
+
+	root_dirty = 1;
+
+	return 0;
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	/* invalid filename */
+	if (!filename_valid(src) || !filename_valid(dst)) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	int slot = root_find(src);
+
+	/* no file found */
+	if (slot == -1) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	struct ECS150file *file = files[slot];
+
+	/* open file, wait for running writes while keeping it open */
+	if (file != NULL) {
+
+		file->refs++;
+
+		pthread_mutex_unlock(&dir_lock);
+
+		pthread_rwlock_rdlock(&file->lock);
+
+		/* the last block is about to be shared, appends must not keep it */
+		int dropped = append_drop(file);
+
+		pthread_mutex_lock(&dir_lock);
+
+		if (dropped) {
+
+			pthread_rwlock_unlock(&file->lock);
+
+			pthread_mutex_unlock(&dir_lock);
+
+			fd_put(file);
+
+			return -1;
+
+		}
+	}
+
+	int ret = root_copy(slot, dst);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	if (file != NULL) {
+
+		pthread_rwlock_unlock(&file->lock);
+
+		fd_put(file);
+
+	}
+
+	return ret;
+}
+
+int fs_snapshot_create(void)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	/* running writes finish first, later ones wait for the snapshot */
+	pthread_rwlock_wrlock(&snapshot_lock);
+
+	pthread_mutex_lock(&dir_lock);
+
+	int dropped = 0;
+
+	/* the last block of a file is about to be shared, appends must not keep it */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		if (files[i] != NULL && append_drop(files[i])) {
+
+			dropped = -1;
+
+		}
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+
+	int id = -1;
+
+	for (int i = 0; i < FS_SNAPSHOT_MAX && id == -1; i++) {
+
+		if (snapshot_table == NULL || snapshot_table[i] == 0) {
+
+			id = i;
+
+		}
+	}
+
+	size_t needed = snapshot_table == NULL ? 2 : 1;
+
+	/* appended bytes not on disk, no identifier left, or no room for the root directory copy */
+	if (dropped || id == -1 || reflink_enable() || free_blocks(needed) < needed) {
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		pthread_rwlock_unlock(&snapshot_lock);
+
+		return -1;
+
+	}
+
+	/* first snapshot on this disk, the table gets a block of its own */
+	if (snapshot_table == NULL) {
+
+		uint16_t *table = (uint16_t *) calloc(1, BLOCK_SIZE);
+
+		uint16_t block = find_first_fit();
+
+		if (table == NULL || cache_write_block(superblock.data + block, table)) {
+
+			free(table);
+
+			pthread_mutex_unlock(&alloc_lock);
+
+			pthread_mutex_unlock(&dir_lock);
+
+			pthread_rwlock_unlock(&snapshot_lock);
+
+			return -1;
+
+		}
+
+		fat_set(block, FAT_EOC);
+
+		snapshot_table = table;
+
+		superblock.snapshot_block = block;
+
+		superblock_dirty = 1;
+
+	}
+
+	uint16_t block = find_first_fit();
+
+	int ret = cache_write_block(superblock.data + block, &Root[0]);
+
+	if (ret == 0) {
+
+		fat_set(block, FAT_EOC);
+
+		/* the frozen entries share the data of the live files */
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+			if (*(char *) &Root[i].filename == '\0') {
+
+				continue;
+
+			}
+
+			if (Root[i].index != FAT_EOC) {
+
+				refcount_inc(Root[i].index);
+
+				if (files[i] != NULL) {
+
+					files[i]->shared = 1;
+
+				}
+			}
+
+			if (Root[i].tail_block != 0) {
+
+				refcount_inc(Root[i].tail_block);
+
+			}
+		}
+
+		memcpy(&superblock.ext_signature, EXT_SIGNATURE, 4);
+
+		superblock.features |= FS_FEATURE_SNAPSHOT;
+
+		superblock_dirty = 1;
+
+		/*
+		 * The references are on the disk before the snapshot is listed: a
+		 * crash in between leaks blocks, but never frees shared ones.
+		 */
+		ret = metadata_flush();
+
+		if (ret == 0) {
+
+			snapshot_table[id] = block;
+
+			ret = cache_write(superblock.data + superblock.snapshot_block, &block, id * sizeof(uint16_t), sizeof(uint16_t));
+
+		}
+
+		if (ret != 0) {
+
+			snapshot_table[id] = 0;
+
+			snapshot_release(block);
+
+		}
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	pthread_rwlock_unlock(&snapshot_lock);
+
+	return ret == 0 ? id : -1;
+}
+
+int fs_snapshot_delete(int id)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	pthread_mutex_lock(&alloc_lock);
+
+	/* no such snapshot */
+	if (id < 0 || id >= FS_SNAPSHOT_MAX || snapshot_table == NULL || snapshot_table[id] == 0) {
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	uint16_t block = snapshot_table[id];
+
+	uint16_t none = 0;
+
+	/* unlisted first, a crash then only leaks the blocks of the snapshot */
+	if (cache_write(superblock.data + superblock.snapshot_block, &none, id * sizeof(uint16_t), sizeof(uint16_t))) {
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	snapshot_table[id] = 0;
+
+	snapshot_release(block);
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return 0;
+}
+
+int fs_snapshot_mount(const char *diskname, int id)
+{
+	if (fs_mount(diskname)) {
+
+		return -1;
+
+	}
+
+	readonly = 1;
+
+	/* no such snapshot, or its root directory cannot be read */
+	if (id < 0 || id >= FS_SNAPSHOT_MAX || snapshot_table == NULL || snapshot_table[id] == 0 || cache_read(superblock.data + snapshot_table[id], &Root[0], 0, BLOCK_SIZE)) {
+
+		fs_umount();
+
+		return -1;
+
+	}
+
+	return 0;
+}
+
+/* Root entry walked by fs_check(), live or frozen in a snapshot */
+struct check_entry {
+	/* Root entry */
+	struct file_entry *entry;
+	/* Snapshot holding the entry, -1 for the live root directory */
+	int snapshot;
+	/* Blocks of the chain (map blocks for a mapped file) walked before a problem */
+	size_t valid;
+	/* Problems found (CHECK_*) */
+	int problems;
+};
+
+/* State shared by the threads of fs_check() */
+struct check_state {
+	/* Root entries to walk */
+	struct check_entry *entries;
+	size_t entry_count;
+	/* Next root entry to walk (updated atomically) */
+	size_t next_entry;
+	/* Root directories of the snapshots, NULL for unused identifiers */
+	struct file_entry *snapshots[FS_SNAPSHOT_MAX];
+	/* Bitmap of the data blocks reached, set atomically */
+	uint8_t *visited;
+	/* Links, root entries and map entries pointing to each data block */
+	uint32_t *pointers;
+	/* Live and frozen root entries whose packed tail is in each data block */
+	uint32_t *live_packs;
+	uint32_t *snapshot_packs;
+	/* Whether the chain of a metadata table is broken */
+	int metadata_broken;
+	/* Counters being filled */
+	struct fs_check_report *report;
+};
+
+/* Thread of fs_check(), with the range of data blocks it checks */
+struct check_worker {
+	pthread_t thread;
+	struct check_state *state;
+	size_t from;
+	size_t to;
+};
+
+/* Mark data block @block as reached. Return 1 for the first visit, 0 otherwise */
+int check_visit(struct check_state *state, uint16_t block)
+{
+	uint8_t bit = 1 << (block % 8);
+
+	return !(__atomic_fetch_or(&state->visited[block / 8], bit, __ATOMIC_RELAXED) & bit);
+}
+
+/* Count one more pointer to data block @block */
+void check_point(struct check_state *state, uint16_t block)
+{
+	__atomic_add_fetch(&state->pointers[block], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Check the entries of map block @block: each one is a hole or an unchained
+ * data block. Return CHECK_MAP if some are not, 0 otherwise.
+ */
+int check_map(struct check_state *state, uint16_t block)
+{
+	uint16_t map[MAP_ENTRIES];
+
+	if (block_read(superblock.data + block, map)) {
+
+		return CHECK_MAP;
+
+	}
+
+	int problems = 0;
+
+	for (int e = 0; e < MAP_ENTRIES; e++) {
+
+		uint16_t data = map[e];
+
+		if (data == 0) {
+
+			continue;
+
+		}
+
+		if (data >= superblock.total_data_blocks || FAT[data] != FAT_EOC) {
+
+			problems = CHECK_MAP;
+
+			continue;
+
+		}
+
+		check_visit(state, data);
+
+		check_point(state, data);
+
+	}
+
+	return problems;
+}
+
+/*
+ * Walk the chain starting at @block, marking its blocks as reached and
+ * counting the links of the blocks reached for the first time, and the entries
+ * of map blocks if @mapped. The number of blocks walked is stored in @valid.
+ *
+ * Return: CHECK_BROKEN if the chain links to a free or out of bounds block,
+ * CHECK_CYCLIC if it is longer than the disk, with CHECK_MAP if a map block
+ * has invalid entries. 0 otherwise.
+ */
+int check_chain(struct check_state *state, uint16_t block, int mapped, size_t *valid)
+{
+	size_t n = superblock.total_data_blocks;
+
+	int problems = 0;
+
+	*valid = 0;
+
+	while (block != FAT_EOC) {
+
+		/* link to a free or out of bounds block */
+		if (block >= n || FAT[block] == 0) {
+
+			return problems | CHECK_BROKEN;
+
+		}
+
+		/* longer than the disk, the chain loops */
+		if (*valid == n) {
+
+			return problems | CHECK_CYCLIC;
+
+		}
+
+		/* what follows a block shared by several chains is only counted once */
+		if (check_visit(state, block)) {
+
+			if (FAT[block] != FAT_EOC && FAT[block] < n) {
+
+				check_point(state, FAT[block]);
+
+			}
+
+			if (mapped) {
+
+				problems |= check_map(state, block);
+
+			}
+		}
+
+		(*valid)++;
+
+		block = FAT[block];
+
+	}
+
+	return problems;
+}
+
+/* Walk the chain and the packed tail of root entry @ce */
+void check_entry(struct check_state *state, struct check_entry *ce)
+{
+	struct file_entry *entry = ce->entry;
+
+	size_t n = superblock.total_data_blocks;
+
+	size_t blocks = (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	int mapped = (superblock.features & FS_FEATURE_SPARSE) && (entry->flags & FILE_MAPPED);
+
+	if (entry->index < n) {
+
+		check_point(state, entry->index);
+
+	}
+
+	ce->problems = check_chain(state, entry->index, mapped, &ce->valid);
+
+	size_t expected = entry->tail_block != 0 ? entry->size / BLOCK_SIZE : blocks;
+
+	/* the map may go past the end of file, never stop before it */
+	if (mapped) {
+
+		size_t needed = (blocks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+
+		expected = ce->valid < needed ? needed : ce->valid;
+
+	}
+
+	if (!(ce->problems & (CHECK_BROKEN | CHECK_CYCLIC)) && ce->valid != expected) {
+
+		ce->problems |= CHECK_LENGTH;
+
+	}
+
+	uint16_t tail = entry->tail_block;
+
+	size_t len = entry->size % BLOCK_SIZE;
+
+	if (tail != 0) {
+
+		if (mapped || tail >= n || FAT[tail] != FAT_EOC || len == 0 || entry->tail_offset + len > BLOCK_SIZE) {
+
+			ce->problems |= CHECK_TAIL;
+
+		} else {
+
+			check_visit(state, tail);
+
+			__atomic_add_fetch(ce->snapshot < 0 ? &state->live_packs[tail] : &state->snapshot_packs[tail], 1, __ATOMIC_RELAXED);
+
+		}
+	}
+
+	struct fs_check_report *report = state->report;
+
+	if (ce->problems & (CHECK_BROKEN | CHECK_TAIL | CHECK_MAP)) {
+
+		__atomic_add_fetch(&report->broken_chains, 1, __ATOMIC_RELAXED);
+
+	}
+
+	if (ce->problems & CHECK_CYCLIC) {
+
+		__atomic_add_fetch(&report->cyclic_chains, 1, __ATOMIC_RELAXED);
+
+	}
+
+	if (ce->problems & CHECK_LENGTH) {
+
+		__atomic_add_fetch(&report->size_mismatches, 1, __ATOMIC_RELAXED);
+
+	}
+}
+
+/* Walk root entries until there are none left */
+void *check_entries_worker(void *arg)
+{
+	struct check_worker *worker = (struct check_worker *) arg;
+
+	struct check_state *state = worker->state;
+
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&state->next_entry, 1, __ATOMIC_RELAXED)) < state->entry_count) {
+
+		check_entry(state, &state->entries[i]);
+
+	}
+
+	return NULL;
+}
+
+/* References expected to data block @block, from its reference count */
+size_t check_expected(uint16_t block)
+{
+	return refcount != NULL ? (size_t) refcount[block] + 1 : 1;
+}
+
+/* References found to data block @block, a pack block counting once for all its live fragments */
+size_t check_found(struct check_state *state, uint16_t block)
+{
+	return state->pointers[block] + state->snapshot_packs[block] + (state->live_packs[block] > 0);
+}
+
+/* Whether data block @block was reached */
+int check_visited(struct check_state *state, uint16_t block)
+{
+	return (state->visited[block / 8] >> (block % 8)) & 1;
+}
+
+/* Count the leaked blocks and wrong reference counts in a range of data blocks */
+void *check_blocks_worker(void *arg)
+{
+	struct check_worker *worker = (struct check_worker *) arg;
+
+	struct check_state *state = worker->state;
+
+	struct fs_check_report *report = state->report;
+
+	for (size_t block = worker->from; block < worker->to; block++) {
+
+		if (!check_visited(state, block)) {
+
+			if (FAT[block] != 0) {
+
+				__atomic_add_fetch(&report->leaked_blocks, 1, __ATOMIC_RELAXED);
+
+			}
+
+			continue;
+
+		}
+
+		size_t found = check_found(state, block);
+
+		size_t expected = check_expected(block);
+
+		if (found > expected) {
+
+			__atomic_add_fetch(&report->cross_linked_blocks, 1, __ATOMIC_RELAXED);
+
+		} else if (found < expected) {
+
+			__atomic_add_fetch(&report->refcount_errors, 1, __ATOMIC_RELAXED);
+
+		}
+	}
+
+	return NULL;
+}
+
+/* Release the state of fs_check() */
+void check_free(struct check_state *state)
+{
+	for (int i = 0; i < FS_SNAPSHOT_MAX; i++) {
+
+		free(state->snapshots[i]);
+
+	}
+
+	free(state->entries);
+
+	free(state->visited);
+
+	free(state->pointers);
+
+	free(state->live_packs);
+
+	free(state->snapshot_packs);
+
+	memset(state, 0, sizeof(struct check_state));
+}
+
+/* Walk the metadata chain of @count blocks starting at @block */
+void check_metadata(struct check_state *state, uint16_t block, size_t count)
+{
+	size_t valid;
+
+	if (block >= superblock.total_data_blocks) {
+
+		state->metadata_broken = 1;
+
+		state->report->broken_chains++;
+
+		return;
+
+	}
+
+	check_point(state, block);
+
+	if (check_chain(state, block, 0, &valid) || valid != count) {
+
+		state->metadata_broken = 1;
+
+		state->report->broken_chains++;
+
+	}
+}
+
+/*
+ * Check the mounted file system, filling @report. The chains of the root
+ * entries are walked by several threads, then each thread checks a range of
+ * data blocks.
+ *
+ * Return: -1 if memory cannot be allocated, otherwise the number of problems.
+ */
+int check_run(struct check_state *state, struct fs_check_report *report)
+{
+	size_t n = superblock.total_data_blocks;
+
+	memset(state, 0, sizeof(struct check_state));
+
+	state->report = report;
+
+	state->entries = (struct check_entry *) calloc(FS_FILE_MAX_COUNT * (FS_SNAPSHOT_MAX + 1), sizeof(struct check_entry));
+
+	state->visited = (uint8_t *) calloc(n / 8 + 1, sizeof(uint8_t));
+
+	state->pointers = (uint32_t *) calloc(n, sizeof(uint32_t));
+
+	state->live_packs = (uint32_t *) calloc(n, sizeof(uint32_t));
+
+	state->snapshot_packs = (uint32_t *) calloc(n, sizeof(uint32_t));
+
+	if (state->entries == NULL || state->visited == NULL || state->pointers == NULL || state->live_packs == NULL || state->snapshot_packs == NULL) {
+
+		check_free(state);
+
+		return -1;
+
+	}
+
+	/* the entry of the first data block is reserved */
+	check_visit(state, 0);
+
+	check_point(state, 0);
+
+	if (refcount != NULL) {
+
+		check_metadata(state, superblock.refcount_block, refcount_count);
+
+	}
+
+	if (superblock.journal_count > 0) {
+
+		check_metadata(state, superblock.journal_block, superblock.journal_count);
+
+	}
+
+	if (snapshot_table != NULL) {
+
+		check_metadata(state, superblock.snapshot_block, 1);
+
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+		if (*(char *) &Root[i].filename != '\0') {
+
+			state->entries[state->entry_count].entry = &Root[i];
+
+			state->entries[state->entry_count++].snapshot = -1;
+
+		}
+	}
+
+	for (int id = 0; snapshot_table != NULL && id < FS_SNAPSHOT_MAX; id++) {
+
+		uint16_t block = snapshot_table[id];
+
+		if (block == 0) {
+
+			continue;
+
+		}
+
+		/* a snapshot with no readable root directory cannot be walked */
+		if (block >= n || FAT[block] != FAT_EOC || (state->snapshots[id] = (struct file_entry *) malloc(BLOCK_SIZE)) == NULL || block_read(superblock.data + block, state->snapshots[id])) {
+
+			free(state->snapshots[id]);
+
+			state->snapshots[id] = NULL;
+
+			report->broken_chains++;
+
+			continue;
+
+		}
+
+		check_visit(state, block);
+
+		check_point(state, block);
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+
+			if (*(char *) &state->snapshots[id][i].filename != '\0') {
+
+				state->entries[state->entry_count].entry = &state->snapshots[id][i];
+
+				state->entries[state->entry_count++].snapshot = id;
+
+			}
+		}
+	}
+
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	threads = threads < 1 ? 1 : threads > CHECK_THREADS_MAX ? CHECK_THREADS_MAX : threads;
+
+	struct check_worker workers[CHECK_THREADS_MAX];
+
+	for (long t = 0; t < threads; t++) {
+
+		workers[t].state = state;
+
+		workers[t].from = n * t / threads;
+
+		workers[t].to = n * (t + 1) / threads;
+
+	}
+
+	/* the blocks can only be counted once every chain has been walked */
+	void *(*phases[2])(void *) = { check_entries_worker, check_blocks_worker };
+
+	for (int phase = 0; phase < 2; phase++) {
+
+		long started = 0;
+
+		while (started < threads && pthread_create(&workers[started].thread, NULL, phases[phase], &workers[started]) == 0) {
+
+			started++;
+
+		}
+
+		/* no thread at all, do the work in this one */
+		if (started == 0) {
+
+			for (long t = 0; t < threads; t++) {
+
+				phases[phase](&workers[t]);
+
+			}
+		}
+
+		for (long t = 0; t < started; t++) {
+
+			pthread_join(workers[t].thread, NULL);
+
+		}
+
+		/* threads that could not start leave their blocks to this one */
+		for (long t = started; started > 0 && phase == 1 && t < threads; t++) {
+
+			check_blocks_worker(&workers[t]);
+
+		}
+	}
+
+	return report->geometry_errors + report->leaked_blocks + report->cross_linked_blocks + report->refcount_errors + report->cyclic_chains + report->broken_chains + report->size_mismatches;
+}
+
+/* Fix the chain and packed tail of root entry @ce, return 1 if it changed */
+int check_repair_entry(struct check_entry *ce)
+{
+	struct file_entry *entry = ce->entry;
+
+	int mapped = (superblock.features & FS_FEATURE_SPARSE) && (entry->flags & FILE_MAPPED);
+
+	if (ce->problems == 0) {
+
+		return 0;
+
+	}
+
+	/* an invalid tail is dropped, with the partial block it held */
+	if (ce->problems & CHECK_TAIL) {
+
+		entry->tail_block = 0;
+
+		entry->tail_offset = 0;
+
+		entry->size -= entry->size % BLOCK_SIZE;
+
+	}
+
+	size_t unit = mapped ? (size_t) MAP_ENTRIES * BLOCK_SIZE : BLOCK_SIZE;
+
+	size_t expected = mapped ? ce->valid : entry->tail_block != 0 ? entry->size / BLOCK_SIZE : (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	size_t keep = ce->valid < expected ? ce->valid : expected;
+
+	/* the file stops where its chain does, a packed tail cannot follow a shortened chain */
+	if (keep * unit < entry->size) {
+
+		entry->size = keep * unit;
+
+		entry->tail_block = 0;
+
+		entry->tail_offset = 0;
+
+	}
+
+	if (ce->problems & (CHECK_BROKEN | CHECK_CYCLIC | CHECK_LENGTH)) {
+
+		if (keep == 0) {
+
+			entry->index = FAT_EOC;
+
+		} else {
+
+			fat_set(chain_seek(entry->index, (keep - 1) * BLOCK_SIZE), FAT_EOC);
+
+		}
+	}
+
+	/* entries of the map blocks pointing to invalid blocks become holes */
+	uint16_t block = entry->index;
+
+	for (size_t i = 0; mapped && (ce->problems & CHECK_MAP) && i < keep; i++) {
+
+		uint16_t map[MAP_ENTRIES];
+
+		int changed = 0;
+
+		if (block_read(superblock.data + block, map)) {
+
+			break;
+
+		}
+
+		for (int e = 0; e < MAP_ENTRIES; e++) {
+
+			if (map[e] != 0 && (map[e] >= superblock.total_data_blocks || FAT[map[e]] != FAT_EOC)) {
+
+				map[e] = 0;
+
+				changed = 1;
+
+			}
+		}
+
+		if (changed) {
+
+			cache_write_block(superblock.data + block, map);
+
+		}
+
+		block = FAT[block];
+
+	}
+
+	if (ce->snapshot < 0) {
+
+		root_dirty = 1;
+
+	}
+
+	return 1;
+}
+
+/*
+ * Repair the problems found by check_run(): shorten the broken chains and
+ * root entries, then check again and free the leaked blocks and fix the
+ * reference counts.
+ */
+void check_repair(struct check_state *state)
+{
+	int snapshot_dirty[FS_SNAPSHOT_MAX] = { 0 };
+
+	/* the blocks of the tables are known, only their links can be wrong */
+	if (state->metadata_broken) {
+
+		for (size_t i = 0; i < refcount_count; i++) {
+
+			fat_set(refcount_chain[i], i + 1 < refcount_count ? refcount_chain[i + 1] : FAT_EOC);
+
+		}
+
+		for (size_t i = 0; i < superblock.journal_count; i++) {
+
+			uint16_t block = superblock.journal_block + i;
+
+			fat_set(block, i + 1 < superblock.journal_count ? block + 1 : FAT_EOC);
+
+		}
+
+		if (snapshot_table != NULL) {
+
+			fat_set(superblock.snapshot_block, FAT_EOC);
+
+		}
+	}
+
+	for (size_t i = 0; i < state->entry_count; i++) {
+
+		struct check_entry *ce = &state->entries[i];
+
+		if (check_repair_entry(ce) && ce->snapshot >= 0) {
+
+			snapshot_dirty[ce->snapshot] = 1;
+
+		}
+	}
+
+	for (int id = 0; snapshot_table != NULL && id < FS_SNAPSHOT_MAX; id++) {
+
+		if (snapshot_dirty[id]) {
+
+			cache_write_block(superblock.data + snapshot_table[id], state->snapshots[id]);
+
+		}
+
+		/* unreadable snapshots are dropped from the table */
+		if (snapshot_table[id] != 0 && state->snapshots[id] == NULL) {
+
+			snapshot_table[id] = 0;
+
+			cache_write_block(superblock.data + superblock.snapshot_block, snapshot_table);
+
+		}
+	}
+
+	struct fs_check_report report;
+
+	memset(&report, 0, sizeof(report));
+
+	check_free(state);
+
+	if (check_run(state, &report) < 0) {
+
+		return;
+
+	}
+
+	size_t n = superblock.total_data_blocks;
+
+	int shared = 0;
+
+	for (size_t block = 0; block < n; block++) {
+
+		if (!check_visited(state, block)) {
+
+			if (FAT[block] != 0) {
+
+				fat_set(block, 0);
+
+			}
+
+			if (refcount != NULL && refcount[block] != 0) {
+
+				refcount_set(block, 0);
+
+			}
+
+		} else if (check_found(state, block) > 1) {
+
+			shared = 1;
+
+		}
+	}
+
+	/* cross-linked blocks become shared blocks, copied on write */
+	if (shared && reflink_enable()) {
+
+		return;
+
+	}
+
+	for (size_t block = 0; refcount != NULL && block < n; block++) {
+
+		size_t found = check_found(state, block);
+
+		if (check_visited(state, block) && found > 0 && found != check_expected(block)) {
+
+			refcount_set(block, found - 1);
+
+		}
+	}
+}
+
+int fs_check(const char *diskname, int flags, struct fs_check_report *report)
+{
+	/* the disk of the mounted file system is the only one open */
+	if (mounted) {
+
+		return -1;
+
+	}
+
+	/* unknown flags */
+	if (report == NULL || (flags & ~FS_CHECK_REPAIR)) {
+
+		return -1;
+
+	}
+
+	memset(report, 0, sizeof(struct fs_check_report));
+
+	if (block_disk_open(diskname)) {
+
+		return -1;
+
+	}
+
+	struct superblock *sb = (struct superblock *) malloc(sizeof(struct superblock));
+
+	if (sb == NULL || block_read(0, sb) || memcmp(&sb->signature, "ECS150FS", 8)) {
+
+		free(sb);
+
+		block_disk_close();
+
+		return -1;
+
+	}
+
+	size_t fat_count = (sb->total_data_blocks + 2047) / 2048;
+
+	size_t checks[] = {
+		sb->total_data_blocks == 0 || sb->total_data_blocks > FS_DATA_BLOCK_MAX,
+		sb->FAT_count != fat_count,
+		sb->root != sb->FAT_count + 1,
+		sb->data != sb->root + 1,
+		sb->total_block_disk != sb->data + sb->total_data_blocks,
+		(int) sb->total_block_disk != block_disk_count(),
+	};
+
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+
+		report->geometry_errors += checks[i];
+
+	}
+
+	free(sb);
+
+	block_disk_close();
+
+	/* nothing else can be located */
+	if (report->geometry_errors > 0) {
+
+		return report->geometry_errors;
+
+	}
+
+	/* the metadata tables (journal, reference counts, snapshots) cannot be read */
+	if (fs_mount(diskname)) {
+
+		report->geometry_errors++;
+
+		return report->geometry_errors;
+
+	}
+
+	/* only a repair writes to the disk */
+	readonly = !(flags & FS_CHECK_REPAIR);
+
+	struct check_state state;
+
+	int problems = check_run(&state, report);
+
+	if (problems > 0 && (flags & FS_CHECK_REPAIR)) {
+
+		check_repair(&state);
+
+		check_free(&state);
+
+		struct fs_check_report after;
+
+		memset(&after, 0, sizeof(after));
+
+		int left = check_run(&state, &after);
+
+		report->repaired = left < 0 ? 0 : problems - left;
+
+	}
+
+	check_free(&state);
+
+	if (problems < 0 || fs_umount()) {
+
+		return -1;
+
+	}
+
+	return problems;
+}
+
+int fs_create_many(const char **filenames, size_t count, int *results)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	if (filenames == NULL || results == NULL) {
+
+		return -1;
+
+	}
+
+	int created = 0;
+
+	int next_slot = 0;
+
+	pthread_mutex_lock(&dir_lock);
+
+	for (size_t i = 0; i < count; i++) {
+
+		results[i] = -1;
+
+		/* invalid filename or existing filename */
+		if (!filename_valid(filenames[i]) || root_find(filenames[i]) != -1) {
+
+			continue;
+
+		}
+
+		/* duplicate within the batch */
+		int duplicate = 0;
+
+		for (size_t j = 0; j < i; j++) {
+
+			if (results[j] == 0 && !strcmp(filenames[j], filenames[i])) {
+
+				duplicate = 1;
+				break;
+
+			}
+		}
+
+		if (duplicate) {
+
+			continue;
+
+		}
+
+		/* free slots are only consumed, so the scan resumes where it stopped */
+		while (next_slot < FS_FILE_MAX_COUNT && *(char *) &Root[next_slot].filename != '\0') {
+
+			next_slot++;
+
+		}
+
+		/* no more space */
+		if (next_slot == FS_FILE_MAX_COUNT) {
+
+			continue;
+
+		}
+
+		memset(&Root[next_slot], 0, sizeof(struct file_entry));
+
+		strcpy((char *) &Root[next_slot].filename, filenames[i]);
+
+		Root[next_slot].index = FAT_EOC;
+
+		results[i] = 0;
+
+		created++;
+
+	}
+
+	root_dirty = root_dirty || created;
+
+	pthread_mutex_lock(&alloc_lock);
+
+	/* persist the whole batch at once */
+	if (metadata_flush()) {
+
+		created = -1;
+
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return created;
+}
+
+int fs_delete_many(const char **filenames, size_t count, int *results)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
+
+		return -1;
+
+	}
+
+	if (filenames == NULL || results == NULL) {
+
+		return -1;
+
+	}
+
+	int deleted = 0;
+
+	pthread_mutex_lock(&dir_lock);
+
+	pthread_mutex_lock(&alloc_lock);
+
+	for (size_t i = 0; i < count; i++) {
+
+		results[i] = -1;
+
+		/* invalid filename */
+		if (!filename_valid(filenames[i])) {
+
+			continue;
+
+		}
+
+		int slot = root_find(filenames[i]);
+
+		/* no file found (or already deleted earlier in the batch) */
+		if (slot == -1) {
+
+			continue;
+
+		}
+
+		/* currently open */
+		if (files[slot] != NULL) {
+
+			continue;
+
+		}
+
+		root_release(slot);
+
+		results[i] = 0;
+
+		deleted++;
+
+	}
+
+	/* persist the whole batch at once */
+	if (metadata_flush()) {
+
+		deleted = -1;
+
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return deleted;
+}
+
+int fs_readdir(struct fs_dirent *entries, size_t max)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	if (entries == NULL && max > 0) {
+
+		return -1;
+
+	}
+
+	size_t count = 0;
+
+	pthread_mutex_lock(&dir_lock);
+
+	pthread_mutex_lock(&alloc_lock);
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT && count < max; i++) {
+
+		if (*(char *) &Root[i].filename == '\0') {
+
+			continue;
+
+		}
+
+		struct fs_dirent *entry = &entries[count++];
+
+		memcpy(entry->name, &Root[i].filename, FS_FILENAME_LEN);
+
+		entry->name[FS_FILENAME_LEN - 1] = '\0';
+
+		entry->size = Root[i].size;
+
+		entry->first_block = Root[i].index;
+
+		entry->block_count = 0;
+
+		/* bounded walk, so a corrupted chain cannot loop forever */
+		uint16_t block = Root[i].index;
+
+		while (block != FAT_EOC && block < superblock.total_data_blocks
+		       && entry->block_count < superblock.total_data_blocks) {
+
+			entry->block_count++;
+
+			/* data blocks listed by a map block */
+			for (int e = 0; file_mapped(i) && e < MAP_ENTRIES; e++) {
+
+				uint16_t data = 0;
+
+				cache_read(superblock.data + block, &data, e * sizeof(uint16_t), sizeof(uint16_t));
+
+				if (data != 0) {
+
+					entry->block_count++;
+
+				}
+			}
+
+			block = FAT[block];
+
+		}
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return count;
+}
+
+int fs_ls(void)
+{
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+
+	int count = fs_readdir(entries, FS_FILE_MAX_COUNT);
+
+	/* no disk mounted */
+	if (count < 0) {
+
+		return -1;
+
+	}
+
+	printf("FS Ls:\n");
+
+	for (int i = 0; i < count; i++) {
+
+		printf("file: %s, size: %zu, data_blk: %d\n", entries[i].name, entries[i].size, entries[i].first_block);
+
+	}
+
+	return 0;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_flags(filename, 0);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	/* unknown flags */
+	if (flags & ~FS_OPEN_APPEND) {
+
+		return -1;
+
+	}
+
+	/* appends modify the file, not possible on a mounted snapshot */
+	if ((flags & FS_OPEN_APPEND) && readonly) {
+
+		return -1;
+
+	}
+
+	/* invalid filename */
+	if (!filename_valid(filename)) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	int slot = root_find(filename);
+
+	/* no file found */
+	if (slot == -1) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	/* lowest unused descriptor, adding a chunk to the table when all are used */
+	int fd = -1;
+
+	for (int i = 0; i < FD_CHUNK_COUNT && fd == -1; i++) {
+
+		if (fds[i] == NULL) {
+
+			struct ECS150fd *chunk = (struct ECS150fd *) calloc(FS_OPEN_MAX_COUNT, sizeof(struct ECS150fd));
+
+			if (chunk == NULL) {
+
+				break;
+
+			}
+
+			for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+
+				pthread_mutex_init(&chunk[j].offset_lock, NULL);
+
+			}
+
+			__atomic_store_n(&fds[i], chunk, __ATOMIC_RELEASE);
+
+		}
+
+		for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+
+			if (fds[i][j].file == NULL) {
+
+				fd = i * FS_OPEN_MAX_COUNT + j;
+				break;
+
+			}
+		}
+	}
+
+	/* file not open yet, set up its shared state */
+	if (fd != -1 && files[slot] == NULL) {
+
+		struct ECS150file *file = (struct ECS150file *) pool_get(file_pool);
+
+		if (file == NULL) {
+
+			fd = -1;
+
+		} else {
+
+			file->slot = slot;
+
+			file->size = Root[slot].size;
+
+			file->index = Root[slot].index;
+
+			file->refs = 0;
+
+			/* which blocks are shared is not known, a first write finds out */
+			file->shared = __atomic_load_n(&shared_blocks, __ATOMIC_RELAXED) > 0;
+
+			pthread_rwlock_init(&file->lock, NULL);
+
+			file->append_data = NULL;
+
+			file->append_dirty = 0;
+
+			pthread_mutex_init(&file->append_lock, NULL);
+
+			files[slot] = file;
+
+		}
+	}
+
+	/* open file table full */
+	if (fd == -1) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	struct ECS150fd *entry = &fds[fd / FS_OPEN_MAX_COUNT][fd % FS_OPEN_MAX_COUNT];
+
+	entry->offset = 0;
+
+	entry->flags = flags;
+
+	files[slot]->refs++;
+
+	__atomic_store_n(&entry->file, files[slot], __ATOMIC_RELEASE);
+
+	fd_count++;
+
+	pthread_mutex_unlock(&dir_lock);
+
+	return fd;
+}
+
+int fs_close(int fd)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	pthread_mutex_lock(&dir_lock);
+
+	struct ECS150fd *entry = fd_slot(fd);
+
+	struct ECS150file *file = entry == NULL ? NULL : entry->file;
+
+	/* fd not open */
+	if (file == NULL) {
+
+		pthread_mutex_unlock(&dir_lock);
+
+		return -1;
+
+	}
+
+	__atomic_store_n(&entry->file, NULL, __ATOMIC_RELEASE);
+
+	fd_count--;
+
+	int last;
+
+	/* the descriptor is closed either way */
+	int ret = file_put(file, &last);
+
+	pthread_mutex_unlock(&dir_lock);
+
+	if (last) {
+
+		file_free(file);
+
+	}
+
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	struct ECS150fd *entry;
+
+	struct ECS150file *file = fd_entry(fd, &entry);
+
+	/* fd not open */
+	if (file == NULL) {
+
+		return -1;
+
+	}
+
+	pthread_rwlock_rdlock(&file->lock);
+
+	int size = file->size;
+
+	pthread_rwlock_unlock(&file->lock);
+
+	fd_put(file);
+
+	return size;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	/* no disk mounted */
+	if (!mounted) {
+
+		return -1;
+
+	}
+
+	struct ECS150fd *entry;
+
+	struct ECS150file *file = fd_entry(fd, &entry);
+
+	/* fd not open */
+	if (file == NULL) {
+
+		return -1;
+
+	}
+
+	int ret = -1;
+
+	pthread_mutex_lock(&entry->offset_lock);
+
+	pthread_rwlock_rdlock(&file->lock);
+
+	/* past the end of file, a write leaves a gap read back as zeros */
+	if (offset <= INT_MAX) {
+
+		entry->offset = offset;
+
+		ret = 0;
+
+	}
+
+	pthread_rwlock_unlock(&file->lock);
+
+	pthread_mutex_unlock(&entry->offset_lock);
+
+	fd_put(file);
+
+	return ret;
+}
+
+/* Position in an array of buffers */
+struct iov_cursor {
+	/* Buffers */
+	const struct iovec *iov;
+	/* Number of buffers */
+	int iovcnt;
+	/* Current buffer */
+	int index;
+	/* Offset in the current buffer */
+	size_t offset;
+};
+
+/* Total size of the @iovcnt buffers of @iov, or -1 if it does not fit an int */
+ssize_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+
+		if (iov[i].iov_len > INT_MAX - total) {
+
+			return -1;
+
+		}
+
+		total += iov[i].iov_len;
+
+	}
+
+	return total;
+}
+
+/*
+ * Return the address of the next @len bytes of @cursor if they sit in a single
+ * buffer, NULL otherwise. The cursor does not move.
+ */
+void *iov_contiguous(struct iov_cursor *cursor, size_t len)
+{
+	/* skip the buffers already used up, and the empty ones */
+	while (cursor->index < cursor->iovcnt && cursor->offset == cursor->iov[cursor->index].iov_len) {
+
+		cursor->index++;
+
+		cursor->offset = 0;
+
+	}
+
+	if (cursor->index == cursor->iovcnt || cursor->iov[cursor->index].iov_len - cursor->offset < len) {
+
+		return NULL;
+
+	}
+
+	return (uint8_t *) cursor->iov[cursor->index].iov_base + cursor->offset;
+}
+
+/*
+ * Move @cursor @len bytes forward, copying them to @to (gather) or from @from
+ * (scatter) when not NULL.
+ */
+void iov_advance(struct iov_cursor *cursor, size_t len, void *to, const void *from)
+{
+	while (len > 0) {
+
+		const struct iovec *v = &cursor->iov[cursor->index];
+
+		size_t chunk = v->iov_len - cursor->offset;
+
+		if (chunk > len) {
+
+			chunk = len;
+
+		}
+
+		if (to != NULL) {
+
+			memcpy(to, (uint8_t *) v->iov_base + cursor->offset, chunk);
+
+			to = (uint8_t *) to + chunk;
+
+		}
+
+		if (from != NULL) {
+
+			memcpy((uint8_t *) v->iov_base + cursor->offset, from, chunk);
+
+			from = (const uint8_t *) from + chunk;
+
+		}
+
+		cursor->offset += chunk;
+
+		len -= chunk;
+
+		if (cursor->offset == v->iov_len) {
+
+			cursor->index++;
+
+			cursor->offset = 0;
+
+		}
+	}
+}
+
+/*
+ * Same as file_write(), for an open file @file using the mapped layout: holes
+ * written to get a block, and blocks shared with copies of the file are
+ * copied, each one as it is reached.
+ */
+size_t file_write_mapped(struct ECS150file *file, const struct iovec *iov, int iovcnt, size_t count, size_t offset)
+{
+	uint8_t *buffer = pool_get(buffer_pool);
+
+	if (buffer == NULL) {
+
+		return 0;
+
+	}
+
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+
+	struct map_cursor map = { file->index, 0, FAT_EOC };
+
+	size_t already_written = 0;
+
+	while (already_written < count) {
+
+		size_t n = (offset + already_written) / BLOCK_SIZE;
+
+		size_t block_offset = (offset + already_written) % BLOCK_SIZE;
+
+		size_t chunk = BLOCK_SIZE - block_offset;
+
+		if (chunk > count - already_written) {
+
+			chunk = count - already_written;
+
+		}
+
+		map_seek(&map, n);
+
+		/* extend the map by zeroed map blocks, up to the one of the block */
+		while (map.map == FAT_EOC) {
+
+			pthread_mutex_lock(&alloc_lock);
+
+			int available = find_first_fit();
+
+			if (available != -1) {
+
+				fat_set(available, FAT_EOC);
+
+				if (map.prev != FAT_EOC) {
+
+					fat_set(map.prev, available);
+
+				}
+			}
+
+			pthread_mutex_unlock(&alloc_lock);
+
+			/* disk full */
+			if (available == -1) {
+
+				break;
+
+			}
+
+			memset(buffer, 0, BLOCK_SIZE);
+
+			/* a map block that cannot be zeroed would point anywhere */
+			if (cache_write_block(superblock.data + available, buffer)) {
+
+				pthread_mutex_lock(&alloc_lock);
+
+				fat_set(available, 0);
+
+				if (map.prev != FAT_EOC) {
+
+					fat_set(map.prev, FAT_EOC);
+
+				}
+
+				pthread_mutex_unlock(&alloc_lock);
+
+				break;
+
+			}
+
+			if (map.prev == FAT_EOC) {
+
+				file_set_index(file, available);
+
+			}
+
+			map.map = available;
+
+			map_seek(&map, n);
+
+		}
+
+		if (map.map == FAT_EOC) {
+
+			break;
+
+		}
+
+		uint16_t block;
+
+		if (map_lookup(&map, n, &block)) {
+
+			break;
+
+		}
+
+		/* hole, or block shared with a copy of the file: it needs a new block */
+		pthread_mutex_lock(&alloc_lock);
+
+		int shared = block != 0 && refcount_shared(block);
+
+		int available = block == 0 || shared ? find_first_fit() : block;
+
+		if (available != -1 && available != block) {
+
+			fat_set(available, FAT_EOC);
+
+		}
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		/* disk full */
+		if (available == -1) {
+
+			break;
+
+		}
+
+		if (available != block) {
+
+			int ret = 0;
+
+			/* the bytes around the data keep their value, zeros for a hole */
+			if (chunk < BLOCK_SIZE && shared) {
+
+				ret = cache_read(superblock.data + block, buffer, 0, BLOCK_SIZE);
+
+			} else if (chunk < BLOCK_SIZE) {
+
+				memset(buffer, 0, BLOCK_SIZE);
+
+			}
+
+			if (ret == 0) {
+
+				iov_advance(&cursor, chunk, buffer + block_offset, NULL);
+
+				ret = cache_write_block(superblock.data + available, buffer);
+
+			}
+
+			/* the map only points to the block once its data is on the disk */
+			if (ret == 0) {
+
+				ret = map_set(&map, n, available);
+
+			}
+
+			if (ret) {
+
+				pthread_mutex_lock(&alloc_lock);
+
+				fat_set(available, 0);
+
+				pthread_mutex_unlock(&alloc_lock);
+
+				break;
+
+			}
+
+			if (shared) {
+
+				pthread_mutex_lock(&alloc_lock);
+
+				refcount_drop(block);
+
+				pthread_mutex_unlock(&alloc_lock);
+
+			}
+
+		} else {
+
+			const uint8_t *src = iov_contiguous(&cursor, chunk);
+
+			/* data spread over several buffers */
+			if (src == NULL) {
+
+				iov_advance(&cursor, chunk, buffer + block_offset, NULL);
+
+				src = buffer + block_offset;
+
+			} else {
+
+				iov_advance(&cursor, chunk, NULL, NULL);
+
+			}
+
+			int ret;
+
+			if (chunk == BLOCK_SIZE) {
+
+				ret = cache_write_block(superblock.data + block, src);
+
+			} else {
+
+				ret = cache_write(superblock.data + block, src, block_offset, chunk);
+
+			}
+
+			if (ret) {
+
+				break;
+
+			}
+		}
+
+		already_written += chunk;
+
+	}
+
+	pool_put(buffer_pool, buffer);
+
+	if (offset + already_written > file->size) {
+
+		file_set_size(file, offset + already_written);
+
+	}
+
+	return already_written;
+}
+
+/*
+ * Second half of file_write(), once the file ends before @offset or on a block
+ * boundary: give the file the layout and the private blocks the write needs,
+ * then write the data.
+ */
+size_t file_write_blocks(struct ECS150file *file, const struct iovec *iov, int iovcnt, size_t count, size_t offset)
+{
+	/* whole blocks skipped, they become holes of a block map */
+	if (offset / BLOCK_SIZE > file->size / BLOCK_SIZE && !file_mapped(file->slot)) {
+
+		pthread_mutex_lock(&dir_lock);
+
+		pthread_mutex_lock(&alloc_lock);
+
+		int ret = map_convert(file->slot);
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		if (ret) {
+
+			return 0;
+
+		}
+	}
+
+	int mapped = file_mapped(file->slot);
+
+	/* blocks shared with copies of the file are copied before being modified */
+	if (file->shared && (file->size > 0 || mapped)) {
+
+		/* a map block covers MAP_ENTRIES blocks of the file */
+		size_t unit = mapped ? (size_t) BLOCK_SIZE * MAP_ENTRIES : BLOCK_SIZE;
+
+		/* written blocks, and the last block if the file grows (the map can end past it) */
+		size_t upto = (offset + count - 1) / unit;
+
+		if (!mapped && (file->size - 1) / unit < upto) {
+
+			upto = (file->size - 1) / unit;
+
+		}
+
+		pthread_mutex_lock(&dir_lock);
+
+		pthread_mutex_lock(&alloc_lock);
+
+		int ret = chain_unshare(file->slot, upto, &file->shared);
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		if (ret) {
+
+			return 0;
+
+		}
+	}
+
+	if (mapped) {
+
+		return file_write_mapped(file, iov, iovcnt, count, offset);
+
+	}
+
+	uint8_t *buffer = pool_get(buffer_pool);
+
+	if (buffer == NULL) {
+
+		return 0;
+
+	}
+
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+
+	uint16_t prev = FAT_EOC;
+
+	uint16_t block = file->index;
+
+	for (size_t i = 0; i < offset / BLOCK_SIZE && block != FAT_EOC; i++) {
+
+		prev = block;
+
+		block = FAT[block];
+
+	}
+
+	size_t already_written = 0;
+
+	while (already_written < count) {
+
+		size_t block_offset = (offset + already_written) % BLOCK_SIZE;
+
+		size_t chunk = BLOCK_SIZE - block_offset;
+
+		if (chunk > count - already_written) {
+
+			chunk = count - already_written;
+
+		}
+
+		int fresh = 0;
+
+		/* extend the file by one block */
+		if (block == FAT_EOC) {
+
+			pthread_mutex_lock(&alloc_lock);
+
+			int available_FAT = find_first_fit();
+
+			if (available_FAT != -1) {
+
+				fat_set(available_FAT, FAT_EOC);
+
+				if (prev != FAT_EOC) {
+
+					fat_set(prev, available_FAT);
+
+				}
+			}
+
+			pthread_mutex_unlock(&alloc_lock);
+
+			/* disk full */
+			if (available_FAT == -1) {
+
+				break;
+
+			}
+
+			if (prev == FAT_EOC) {
+
+				file_set_index(file, available_FAT);
+
+			}
+
+			block = available_FAT;
+
+			fresh = 1;
+
+		}
+
+		const uint8_t *src = iov_contiguous(&cursor, chunk);
+
+		/* new block, the bytes around the data are not part of the file */
+		if (fresh && chunk < BLOCK_SIZE) {
+
+			memset(buffer, 0, BLOCK_SIZE);
+
+			src = NULL;
+
+		}
+
+		/* data spread over several buffers, or padded with zeros */
+		if (src == NULL) {
+
+			iov_advance(&cursor, chunk, buffer + block_offset, NULL);
+
+			src = buffer + block_offset;
+
+		} else {
+
+			iov_advance(&cursor, chunk, NULL, NULL);
+
+		}
+
+		int ret;
+
+		if (chunk == BLOCK_SIZE) {
+
+			/* whole block overwritten, nothing to read first */
+			ret = cache_write_block(superblock.data + block, src);
+
+		} else if (fresh) {
+
+			ret = cache_write_block(superblock.data + block, buffer);
+
+		} else {
+
+			ret = cache_write(superblock.data + block, src, block_offset, chunk);
+
+		}
+
+		/* the file ends with the blocks written so far, without a new block that failed */
+		if (ret) {
+
+			if (fresh) {
+
+				pthread_mutex_lock(&alloc_lock);
+
+				fat_set(block, 0);
+
+				if (prev != FAT_EOC) {
+
+					fat_set(prev, FAT_EOC);
+
+				}
+
+				pthread_mutex_unlock(&alloc_lock);
+
+				if (prev == FAT_EOC) {
+
+					file_set_index(file, FAT_EOC);
+
+				}
+			}
+
+			break;
+
+		}
+
+		already_written += chunk;
+
+		prev = block;
+
+		block = FAT[block];
+
+	}
+
+	pool_put(buffer_pool, buffer);
+
+	if (offset + already_written > file->size) {
+
+		file_set_size(file, offset + already_written);
+
+	}
+
+	return already_written;
+}
+
+/*
+ * Write the @count bytes of the @iovcnt buffers of @iov at byte @offset of
+ * open file @file, extending the file as needed. A gap left between the end
+ * of file and @offset reads back as zeros. The chain is walked once, and
+ * blocks spanning several buffers are assembled before being written. Return
+ * the number of bytes actually written.
+ */
+size_t file_write(struct ECS150file *file, const struct iovec *iov, int iovcnt, size_t count, size_t offset)
+{
+	/* sizes are reported as int */
+	if (offset >= INT_MAX || count == 0) {
+
+		return 0;
+
+	}
+
+	if (count > INT_MAX - offset) {
+
+		count = INT_MAX - offset;
+
+	}
+
+	/* the cached last block of append descriptors goes stale */
+	if (append_drop(file)) {
+
+		return 0;
+
+	}
+
+	/* packed tail goes back to a block of its own while the file changes */
+	if (Root[file->slot].tail_block != 0) {
+
+		pthread_mutex_lock(&dir_lock);
+
+		pthread_mutex_lock(&alloc_lock);
+
+		int ret = tail_unpack(file->slot);
+
+		pthread_mutex_unlock(&alloc_lock);
+
+		pthread_mutex_unlock(&dir_lock);
+
+		if (ret) {
+
+			return 0;
+
+		}
+	}
+
+	size_t size = file->size;
+
+	/* the end of the last block, up to @offset, was never written: zero it first */
+	if (offset > file->size && file->size % BLOCK_SIZE != 0) {
+
+		uint8_t *zeros = pool_get(buffer_pool);
+
+		if (zeros == NULL) {
+
+			return 0;
+
+		}
+
+		memset(zeros, 0, BLOCK_SIZE);
+
+		size_t len = BLOCK_SIZE - file->size % BLOCK_SIZE;
+
+		if (len > offset - file->size) {
+
+			len = offset - file->size;
+
+		}
+
+		struct iovec gap = { zeros, len };
+
+		size_t written = file_write_blocks(file, &gap, 1, len, file->size);
+
+		pool_put(buffer_pool, zeros);
+
+		if (written < len) {
+
+			return 0;
+
+		}
+	}
+
+	size_t written = file_write_blocks(file, iov, iovcnt, count, offset);
+
+	/* nothing written, the zeroed end of the last block stays out of the file */
+	if (written == 0 && file->size != size) {
+
+		file_set_size(file, size);
+
+	}
+
+	return written;
+}
+
+/*
+ * Read up to @count bytes at byte @offset of open file @file into the @iovcnt
+ * buffers of @iov. The chain is walked once, and blocks spanning several
+ * buffers are staged before being split between them. Return the number of
+ * bytes actually read, or -1 if a block cannot be read.
+ */
+ssize_t file_read(struct ECS150file *file, const struct iovec *iov, int iovcnt, size_t count, size_t offset)
+{
+	size_t size = file->size;
+
+	/* end of file */
+	if (offset >= size || count == 0) {
+
+		return 0;
+
+	}
+
+	if (count > size - offset) {
+
+		count = size - offset;
+
+	}
+
+	uint8_t *buffer = pool_get(buffer_pool);
+
+	if (buffer == NULL) {
+
+		return -1;
+
+	}
+
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+
+	struct file_entry *entry = &Root[file->slot];
+
+	/* bytes past the end of the chain live in the packed tail */
+	size_t chain_size = size;
+
+	if (entry->tail_block != 0) {
+
+		chain_size = size - size % BLOCK_SIZE;
+
+	}
+
+	int mapped = file_mapped(file->slot);
+
+	struct map_cursor map = { file->index, 0, FAT_EOC };
+
+	uint16_t block = mapped ? 0 : chain_seek(file->index, offset);
+
+	size_t offset_buf = 0;
+
+	while (offset_buf < count) {
+
+		size_t position = offset + offset_buf;
+
+		int tail = position >= chain_size;
+
+		/* an unreadable map block is not a hole */
+		if (mapped && map_lookup(&map, position / BLOCK_SIZE, &block)) {
+
+			pool_put(buffer_pool, buffer);
+
+			return -1;
+
+		}
+
+		/* chain shorter than the file size */
+		if (!tail && !mapped && block == FAT_EOC) {
+
+			break;
+
+		}
+
+		size_t block_offset = position % BLOCK_SIZE;
+
+		size_t chunk = BLOCK_SIZE - block_offset;
+
+		if (chunk > count - offset_buf) {
+
+			chunk = count - offset_buf;
+
+		}
+
+		uint8_t *dst = iov_contiguous(&cursor, chunk);
+
+		if (dst == NULL) {
+
+			dst = buffer;
+
+		}
+
+		int ret = 0;
+
+		if (tail) {
+
+			ret = cache_read(superblock.data + entry->tail_block, dst, entry->tail_offset + (position - chain_size), chunk);
+
+		} else if (mapped && block == 0) {
+
+			/* hole */
+			memset(dst, 0, chunk);
+
+		} else if (chunk == BLOCK_SIZE) {
+
+			/* whole block, straight into the caller's buffer */
+			ret = block_read(superblock.data + block, dst);
+
+		} else {
+
+			ret = cache_read(superblock.data + block, dst, block_offset, chunk);
+
+		}
+
+		/* the caller's buffer would hold garbage, fail the whole read */
+		if (ret) {
+
+			pool_put(buffer_pool, buffer);
+
+			return -1;
 
-	}
+		}
 
-	printf("FS Ls:\n");
+		/* staged block, split it between the caller's buffers */
+		iov_advance(&cursor, chunk, NULL, dst == buffer ? buffer : NULL);
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		offset_buf += chunk;
 
-		uint8_t empty = '\0';
+		if (!tail && !mapped) {
 
-		if(memcmp(&Root[i].filename, &empty, 1)) {
-			
-			printf("file: %s, size: %d, data_blk: %d\n", (char *) &Root[i].filename, Root[i].size, Root[i].index);
+			block = FAT[block];
 
 		}
 	}
 
-	return 0;
+	pool_put(buffer_pool, buffer);
+
+	return offset_buf;
 }
 
-int fs_open(const char *filename)
+/*
+ * Append the @count bytes of the @iovcnt buffers of @iov to open file @file,
+ * through its cached last block. The first append after the cache was dropped
+ * goes through file_write() and loads the new last block; the following ones
+ * only touch the FAT when a block fills up. Return the number of bytes
+ * actually written.
+ */
+size_t file_append(struct ECS150file *file, const struct iovec *iov, int iovcnt, size_t count)
 {
-	/* no disk mounted */
-	if (!mounted) {
+	/* no chain to keep a last block of, the map is updated on every write */
+	if (file_mapped(file->slot)) {
 
-		return -1;
+		return file_write(file, iov, iovcnt, count, file->size);
 
 	}
 
-	/* max files reached*/
-	if (fd_count == FS_OPEN_MAX_COUNT) {
-		
-		return -1;
-	}
+	if (file->append_data == NULL) {
 
-	/* invalid filename */
-	if (strlen(filename) > FS_FILENAME_LEN - 1) {
-		
-		return -1;
+		size_t written = file_write(file, iov, iovcnt, count, file->size);
 
-	}
+		/* only a successful write leaves a last block private to the file */
+		if (written == 0) {
 
-	char empty = '\0';
+			return 0;
 
-	/* not null terminated */
-	if (memcmp(filename + strlen(filename), &empty, 1)) {
+		}
 
-		return -1;
+		uint8_t *buffer = pool_get(buffer_pool);
 
-	}
+		if (buffer == NULL) {
 
-	int in_root = 0;
+			return written;
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		}
+
+		/* last block of the file, read back if partially filled */
+		uint16_t last = file->size == 0 ? FAT_EOC : chain_seek(file->index, file->size - 1);
+
+		/* without its bytes, the next appends take the regular write path */
+		if (last != FAT_EOC && file->size % BLOCK_SIZE != 0 && cache_read(superblock.data + last, buffer, 0, BLOCK_SIZE)) {
 
-		if (!memcmp(&Root[i].filename, &filename[0], strlen(filename))) {
+			pool_put(buffer_pool, buffer);
 
-			in_root = 1;
+			return written;
 
 		}
-	}
 
-	if (!in_root) {
+		pthread_mutex_lock(&file->append_lock);
 
-		return -1;
+		file->append_data = buffer;
 
-	}
+		file->append_block = last;
 
-	int new_fd = open(filename, O_RDWR);
+		file->append_dirty = 0;
 
-	if (new_fd == -1) {
+		pthread_mutex_unlock(&file->append_lock);
 
-		return -1;
+		return written;
 
 	}
 
-	int index = -1;
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+	size_t written = 0;
 
-		if (fds[i].fd == -1) {
+	while (written < count) {
 
-			index = i;
-			break;
+		size_t used = file->size % BLOCK_SIZE;
 
-		}
-	}
+		uint16_t last = file->append_block;
 
-	strcpy(&fds[index].filename[0], filename);
+		/* last block full (flushed when it filled up), or no block yet */
+		if (used == 0) {
 
-	fds[index].fd = new_fd;
+			pthread_mutex_lock(&alloc_lock);
 
-	fd_count++;
+			int available = find_first_fit();
 
-	return new_fd;
-}
+			if (available != -1) {
 
-int fs_close(int fd)
-{
-	/* no disk mounted */
-	if (!mounted) {
+				fat_set(available, FAT_EOC);
 
-		return -1;
+				if (file->append_block != FAT_EOC) {
 
-	}
+					fat_set(file->append_block, available);
 
-	/* out of bound */
-	if (fd < 0) {
+				}
+			}
 
-		return -1;
-	}
+			pthread_mutex_unlock(&alloc_lock);
 
-	int index = -1;
+			/* disk full */
+			if (available == -1) {
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+				break;
 
-		if (fds[i].fd == fd) {
+			}
 
-			index = i;
-			break;
+			if (file->append_block == FAT_EOC) {
 
-		}
-	}
+				file_set_index(file, available);
 
-	/* fd not found */
-	if (index == -1) {
+			}
 
-		return -1;
+			pthread_mutex_lock(&file->append_lock);
 
-	}
+			file->append_block = available;
 
-	close(fd);
+			memset(file->append_data, 0, BLOCK_SIZE);
 
-	fds[index].fd = -1;
+			pthread_mutex_unlock(&file->append_lock);
 
-	fds[index].offset = 0;
+		}
 
-	fd_count--;
+		size_t chunk = BLOCK_SIZE - used;
 
-	return 0;
-}
+		if (chunk > count - written) {
 
-int fs_stat(int fd)
-{
-	/* no disk mounted */
-	if (!mounted) {
+			chunk = count - written;
 
-		return -1;
+		}
 
-	}
+		pthread_mutex_lock(&file->append_lock);
 
-	/* out of bound */
-	if (fd < 0) {
+		iov_advance(&cursor, chunk, file->append_data + used, NULL);
 
-		return -1;
-	}
+		file->append_dirty = 1;
 
-	int index = -1;
+		pthread_mutex_unlock(&file->append_lock);
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		/* block full, it will not change anymore: it counts once on the disk */
+		if (used + chunk == BLOCK_SIZE && append_flush(file)) {
 
-		if (fds[i].fd == fd) {
+			/* a block allocated for the chunk goes, the file ends where it did */
+			if (used == 0) {
 
-			index = i;
-			break;
+				pthread_mutex_lock(&alloc_lock);
 
-		}
-	}
+				fat_set(file->append_block, 0);
 
-	/* fd not found */
-	if (index == -1) {
+				if (last != FAT_EOC) {
 
-		return -1;
+					fat_set(last, FAT_EOC);
 
-	}
+				}
 
-	//struct stat buf;
+				pthread_mutex_unlock(&alloc_lock);
 
-	//fstat(fd, &buf);
+				if (last == FAT_EOC) {
 
-	int root_index = -1;
+					file_set_index(file, FAT_EOC);
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+				}
+
+				pthread_mutex_lock(&file->append_lock);
+
+				file->append_block = last;
+
+				file->append_dirty = 0;
 
-		if (!memcmp(&Root[i].filename, &fds[index].filename[0], strlen(fds[index].filename))) {
+				pthread_mutex_unlock(&file->append_lock);
+
+			}
 
-			root_index = i;
 			break;
 
 		}
+
+		written += chunk;
+
+		file_set_size(file, file->size + chunk);
+
 	}
 
-	//return buf.st_size;
-	return Root[root_index].size;
+	return written;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
 {
-	/* no disk mounted */
 	if (!mounted) {
 
-		//printf("not mounted\n");
-
 		return -1;
 
 	}
 
-	/* out of bound */
-	if (fd < 0) {
-
-		//printf("OOB\n");
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
 
 		return -1;
-	}
-
-	int index = -1;
-
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-
-		if (fds[i].fd == fd) {
-
-			index = i;
-			break;
 
-		}
 	}
 
-	/* fd not found */
-	if (index == -1) {
-
-		//printf("fdNF\n");
+	if (iov == NULL || iovcnt < 0) {
 
 		return -1;
 
 	}
 
-	/* larger than file size */
-	if ((int) offset > fs_stat(fd)) {
+	ssize_t count = iov_length(iov, iovcnt);
 
-		//printf("larger\n");
+	if (count == -1) {
 
 		return -1;
 
 	}
 
-	fds[index].offset = offset;
+	struct ECS150fd *entry;
 
-	return 0;
-}
-
-int find_index_in_fds (int fd) 
-{
-	int index = -1;
-
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+	struct ECS150file *file = fd_entry(fd, &entry);
 
-		if (fds[i].fd == fd) {
+	if (file == NULL) {
 
-			index = i;
-			break;
+		return -1;
 
-		}
 	}
 
-	return index;
-}
-
-int find_index_in_root (char *filename)
-{
-	int index = -1;
-
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-
-		if (!memcmp(&Root[i].filename, filename, strlen(filename))) {
-
-			index = i;
-			break;
+	pthread_mutex_lock(&entry->offset_lock);
 
-		}
-	}
+	pthread_rwlock_wrlock(&file->lock);
 
-	return index;
-}
+	pthread_rwlock_rdlock(&snapshot_lock);
 
-int find_first_block(int offset, int first_index)
-{
-	int rest_offset = offset;
+	size_t written;
 
-	int block = first_index;
+	/* append descriptors write at the end of the file, wherever their offset */
+	if (entry->flags & FS_OPEN_APPEND) {
 
-	rest_offset -= 4096;
+		written = file_append(file, iov, iovcnt, count);
 
-	while (rest_offset > 0 && block != FAT_EOC) {
+		entry->offset = file->size - written;
 
-		rest_offset -= 4096;
+	} else {
 
-		block = FAT[block];
+		written = file_write(file, iov, iovcnt, count, entry->offset);
 
 	}
 
-	return block;
-}
-
-int find_first_fit()
-{
-	int index = -1;
+	pthread_rwlock_unlock(&snapshot_lock);
 
-	uint16_t *tmp_fat = FAT;
+	pthread_rwlock_unlock(&file->lock);
 
-	for (int i = 0; i < superblock.total_data_blocks; i++) {
+	entry->offset += written;
 
-		if (*tmp_fat == 0) {
-			
-			index = i;
-			break;
+	pthread_mutex_unlock(&entry->offset_lock);
 
-		}
-		
-		tmp_fat++;
-	}
+	fd_put(file);
 
-	return index;
+	return written;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
 {
 	if (!mounted) {
 
@@ -673,202 +6556,210 @@ int fs_write(int fd, void *buf, size_t count)
 
 	}
 
-	if (fd < 0) {
+	if (iov == NULL || iovcnt < 0) {
 
 		return -1;
 
 	}
 
-	if (buf == NULL) {
+	ssize_t count = iov_length(iov, iovcnt);
+
+	if (count == -1) {
 
 		return -1;
-		
+
 	}
 
-	int index_in_fds = find_index_in_fds(fd);
+	struct ECS150fd *entry;
+
+	struct ECS150file *file = fd_entry(fd, &entry);
 
-	if (index_in_fds == -1) {
+	if (file == NULL) {
 
 		return -1;
 
 	}
 
-	char filename[FS_FILENAME_LEN];
-
-	strcpy(&filename[0], &fds[index_in_fds].filename[0]);
-
-	int index_in_root = find_index_in_root(&filename[0]);
+	pthread_mutex_lock(&entry->offset_lock);
 
-	int index_in_FAT = Root[index_in_root].index;
+	pthread_rwlock_rdlock(&file->lock);
 
-	int already_written = 0;
+	/* readers go to the disk, where appended bytes must be first */
+	ssize_t read = append_flush(file) ? -1 : file_read(file, iov, iovcnt, count, entry->offset);
 
-	int first_block = find_first_block(fds[index_in_fds].offset, index_in_FAT);
+	pthread_rwlock_unlock(&file->lock);
 
-	//printf("firstblock %d\n", first_block);
+	/* nothing read, the offset stays */
+	if (read > 0) {
 
-	int current_FAT = first_block;
+		entry->offset += read;
 
-	int remainder = fds[index_in_fds].offset % 4096;
-
-	struct stat size_buf;
+	}
 
-	fstat(fd, &size_buf);
+	pthread_mutex_unlock(&entry->offset_lock);
 
-	int rest_count = count;
+	fd_put(file);
 
-	int extra_block = 0;
+	return read;
+}
 
-	while ((unsigned) already_written < count) {
+int fs_write(int fd, void *buf, size_t count)
+{
+	if (buf == NULL) {
 
-		uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
+		return -1;
 		
-		if (first_block == FAT_EOC) {
+	}
 
-			int available_FAT = find_first_fit();
+	struct iovec iov = { buf, count };
 
-			//printf("firstfit %d\n", available_FAT);
+	return fs_writev(fd, &iov, 1);
+}
 
-			if (available_FAT == -1) {
+int fs_read(int fd, void *buf, size_t count)
+{
+	if (buf == NULL) {
 
-				free(bounce_buffer);
+		return -1;
 
-				break;
+	}
 
-			} else if (current_FAT == FAT_EOC) {
+	struct iovec iov = { buf, count };
 
-				//printf("expand one!\n");
+	return fs_readv(fd, &iov, 1);
+}
 
-				Root[index_in_root].index = available_FAT;
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	if (!mounted) {
 
-				FAT[available_FAT] = FAT_EOC;
+		return -1;
 
-				current_FAT = available_FAT;
+	}
 
-				first_block = available_FAT;
+	/* mounted snapshot, nothing can be modified */
+	if (readonly) {
 
-			} else {
+		return -1;
 
-				FAT[available_FAT] = FAT_EOC;
+	}
 
-				FAT[current_FAT] = available_FAT;
+	if (buf == NULL) {
 
-				current_FAT = available_FAT;
+		return -1;
+		
+	}
 
-				first_block = available_FAT;
+	struct ECS150fd *entry;
 
-			}
+	struct ECS150file *file = fd_entry(fd, &entry);
 
-			remainder = 0;
+	if (file == NULL) {
 
-			extra_block++;
+		return -1;
 
-		}
+	}
 
-		if (remainder == 0 && remainder + rest_count >= 4096) {
+	int ret = -1;
 
-			block_read(superblock.data + first_block, bounce_buffer);
+	pthread_rwlock_wrlock(&file->lock);
 
-			memcpy(bounce_buffer, buf + already_written, 4096);
+	pthread_rwlock_rdlock(&snapshot_lock);
 
-			block_write(superblock.data + first_block, bounce_buffer);
+	/* sizes are reported as int */
+	if (offset <= INT_MAX) {
 
-			rest_count = rest_count - 4096;
+		struct iovec iov = { (void *) buf, count };
 
-			already_written = already_written + 4096;
+		ret = file_write(file, &iov, 1, count, offset);
 
-			remainder = 0;
+	}
 
-			first_block = FAT[first_block];
+	pthread_rwlock_unlock(&snapshot_lock);
 
-			free(bounce_buffer);
+	pthread_rwlock_unlock(&file->lock);
 
-			continue;
+	fd_put(file);
 
-		}
+	return ret;
+}
 
-		if (remainder == 0 && remainder + rest_count < 4096) {
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	if (!mounted) {
 
-			block_read(superblock.data + first_block, bounce_buffer);
+		return -1;
 
-			memcpy(bounce_buffer, buf + already_written, rest_count);
+	}
 
-			block_write(superblock.data + first_block, bounce_buffer);
+	if (buf == NULL) {
 
-			rest_count = 0;
+		return -1;
 
-			already_written = count;
+	}
 
-			remainder = rest_count;
+	struct ECS150fd *entry;
 
-			free(bounce_buffer);
+	struct ECS150file *file = fd_entry(fd, &entry);
 
-			break;
+	if (file == NULL) {
 
-		}
+		return -1;
 
-		if (remainder != 0 && remainder + rest_count < 4096) {
+	}
 
-			block_read(superblock.data + first_block, bounce_buffer);
+	pthread_rwlock_rdlock(&file->lock);
 
-			memcpy(bounce_buffer + remainder, buf + already_written, rest_count);
+	/* readers go to the disk, where appended bytes must be first */
+	struct iovec iov = { buf, count };
 
-			block_write(superblock.data + first_block, bounce_buffer);
+	int ret = append_flush(file) ? -1 : file_read(file, &iov, 1, count, offset);
 
-			rest_count = 0;
+	pthread_rwlock_unlock(&file->lock);
 
-			already_written = count;
+	fd_put(file);
 
-			remainder = remainder + rest_count;
+	return ret;
+}
 
-			free(bounce_buffer);
+/* Write @len zeros, the content of a hole, to host file descriptor @out_fd */
+int hole_send(size_t len, int out_fd)
+{
+	uint8_t *zeros = pool_get(buffer_pool);
 
-			break;
+	if (zeros == NULL) {
 
-		}
+		return -1;
 
-		if (remainder != 0 && remainder + rest_count >= 4096) {
+	}
 
-			//printf("ttt\n");
+	memset(zeros, 0, BLOCK_SIZE);
 
-			block_read(superblock.data + first_block, bounce_buffer);
+	int ret = 0;
 
-			memcpy(bounce_buffer + remainder, buf + already_written, 4096 - remainder);
+	while (len > 0 && ret == 0) {
 
-			block_write(superblock.data + first_block, bounce_buffer);
+		ssize_t n = write(out_fd, zeros, len < BLOCK_SIZE ? len : BLOCK_SIZE);
 
-			rest_count = rest_count - (4096 - remainder);
+		if (n < 0) {
 
-			already_written = already_written + (4096 - remainder);
+			perror("write");
 
-			first_block = FAT[first_block];
+			ret = -1;
 
-			remainder = 0;
+		} else {
 
-			free(bounce_buffer);
+			len -= n;
 
-			continue;
 		}
 	}
 
-	int tmp_offset = fds[index_in_fds].offset + already_written;
-
-	//if (fds[index_in_fds].offset > size_buf.st_size) {
-
-	//	Root[index_in_root].size = fds[index_in_fds].offset;
-
-	//}
-
-	if (tmp_offset > fs_stat(fd)) {
-
-		Root[index_in_root].size = tmp_offset;
+	pool_put(buffer_pool, zeros);
 
-	}
-	
-	return already_written;
+	return ret;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_sendfile(int fd, int host_fd, size_t offset, size_t count)
 {
 	if (!mounted) {
 
@@ -876,195 +6767,189 @@ int fs_read(int fd, void *buf, size_t count)
 
 	}
 
-	if (fd < 0) {
+	if (host_fd < 0) {
 
 		return -1;
 
 	}
 
-	if (buf == NULL) {
+	struct ECS150fd *entry;
+
+	struct ECS150file *file = fd_entry(fd, &entry);
+
+	if (file == NULL) {
 
 		return -1;
 
 	}
 
-	int index_in_fds = find_index_in_fds(fd);
+	pthread_rwlock_rdlock(&file->lock);
 
-	if (index_in_fds == -1) {
+	/* readers go to the disk, where appended bytes must be first */
+	if (append_flush(file)) {
 
-		return -1;
+		pthread_rwlock_unlock(&file->lock);
 
-	}
+		fd_put(file);
 
-	char filename[FS_FILENAME_LEN];
+		return -1;
 
-	strcpy(&filename[0], &fds[index_in_fds].filename[0]);
+	}
 
-	int index_in_root = find_index_in_root(&filename[0]);
+	size_t size = file->size;
 
-	int index_in_FAT = Root[index_in_root].index;
+	/* end of file */
+	if (offset >= size) {
 
-	uint8_t *tmp_buf = (uint8_t *) malloc(count);
+		pthread_rwlock_unlock(&file->lock);
 
-	int rest_count = count;
+		fd_put(file);
 
-	int first_block = find_first_block(fds[index_in_fds].offset, index_in_FAT);
+		return 0;
 
-	int remainder = fds[index_in_fds].offset % 4096;
+	}
 
-	//printf("offset: %d\n", fds[index_in_fds].offset);
+	if (count > size - offset) {
 
-	int offset_buf = 0;
+		count = size - offset;
 
-	struct stat size_buf;
+	}
 
-	fstat(fd, &size_buf);
+	if (count > INT_MAX) {
 
-	while (first_block != FAT_EOC && rest_count > 0) {
+		count = INT_MAX;
 
-		//if (remainder == 0 && rest_count <= 4096 && offset_buf + rest_count > fs_stat(fd)) {
+	}
 
-		//	uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
+	struct file_entry *root = &Root[file->slot];
 
-		//	block_read(superblock.data + first_block, bounce_buffer);
+	/* bytes past the end of the chain live in the packed tail */
+	size_t chain_size = size;
 
-		//	memcpy(offset_buf + tmp_buf, bounce_buffer, fs_stat(fd) - offset_buf);
+	if (root->tail_block != 0) {
 
-		//	offset_buf = fs_stat(fd);
+		chain_size = size - size % BLOCK_SIZE;
 
-		//	free(bounce_buffer);
+	}
 
-		//	break;
+	int mapped = file_mapped(file->slot);
 
-		//}
+	struct map_cursor map = { file->index, 0, FAT_EOC };
 
-		// if (remainder + rest_count <= 4096 && fds[index_in_fds].offset + offset_buf + rest_count > fs_stat(fd)) {
-		if (remainder + rest_count <= 4096 && fds[index_in_fds].offset + offset_buf + rest_count > fs_stat(fd)) {
+	uint16_t block = mapped ? 0 : chain_seek(file->index, offset);
 
-			//printf("aaa\n");
+	size_t sent = 0;
 
-			uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
+	int failed = 0;
 
-			block_read(superblock.data + first_block, bounce_buffer);
+	while (sent < count && !failed) {
 
-			memcpy(offset_buf + tmp_buf, bounce_buffer + remainder, fs_stat(fd) - (offset_buf + fds[index_in_fds].offset));
+		size_t position = offset + sent;
 
-			offset_buf = fs_stat(fd) - fds[index_in_fds].offset;
+		/* an unreadable map block is not a hole */
+		if (mapped && map_lookup(&map, position / BLOCK_SIZE, &block)) {
 
-			free(bounce_buffer);
+			failed = 1;
 
 			break;
 
 		}
 
-		if (fs_stat(fd) - fds[index_in_fds].offset + offset_buf <= (4096 - remainder) && fds[index_in_fds].offset + offset_buf + rest_count > fs_stat(fd)) {
+		if (position >= chain_size) {
 
-			uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
+			failed = block_send(superblock.data + root->tail_block, root->tail_offset + (position - chain_size), count - sent, host_fd);
 
-			block_read(superblock.data + first_block, bounce_buffer);
+			if (!failed) {
 
-			memcpy(offset_buf + tmp_buf, bounce_buffer + remainder, fs_stat(fd) - (offset_buf + fds[index_in_fds].offset));
+				sent = count;
 
-			offset_buf = fs_stat(fd) - fds[index_in_fds].offset;
-
-			free(bounce_buffer);
+			}
 
 			break;
+
 		}
 
-		if (remainder == 0 && remainder + rest_count >= 4096) {
+		/* chain shorter than the file size */
+		if (!mapped && block == FAT_EOC) {
 
-			//printf("bbb\n");
+			break;
 
-			uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
+		}
 
-			block_read(superblock.data + first_block, bounce_buffer);
+		/* blocks following each other on disk go out in a single send */
+		uint16_t first = block;
 
-			memcpy(offset_buf + tmp_buf, bounce_buffer, 4096);
+		size_t len = BLOCK_SIZE - position % BLOCK_SIZE;
 
-			rest_count = rest_count - 4096;
+		size_t n = position / BLOCK_SIZE + 1;
 
-			offset_buf = offset_buf + 4096;
+		/* a map block that cannot be read ends the run, and fails the next one */
+		uint16_t next = FAT_EOC;
 
-			remainder = 0;
+		if (mapped) {
 
-			first_block = FAT[first_block];
+			map_lookup(&map, n, &next);
 
-			free(bounce_buffer);
+		} else {
 
-			continue;
+			next = FAT[block];
 
 		}
 
-		if (remainder != 0 && remainder + rest_count <= 4096) {
+		for (int run = 1; run < SEND_RUN_MAX && sent + len < count && first != 0 && next == block + 1; run++) {
 
-			//printf("ccc\n");
+			block = next;
 
-			uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
+			if (mapped) {
 
-			block_read(superblock.data + first_block, bounce_buffer);
+				map_lookup(&map, ++n, &next);
 
-			memcpy(tmp_buf, bounce_buffer + remainder, count);
+			} else {
 
-			offset_buf = offset_buf + rest_count;
+				next = FAT[block];
 
-			free(bounce_buffer);
+			}
 
-			break;
+			len += BLOCK_SIZE;
 
 		}
 
-		if (remainder != 0 && remainder + rest_count > 4096) {
-
-			//printf("%d\n", remainder);
+		if (len > count - sent) {
 
-			//printf("ddd\n");
+			len = count - sent;
 
-			uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
-
-			block_read(superblock.data + first_block, bounce_buffer);
-
-			memcpy(offset_buf + tmp_buf, bounce_buffer + remainder, 4096 - remainder);
-
-			rest_count = rest_count - (4096 - remainder);
-
-			offset_buf = offset_buf + (4096 - remainder);
+		}
 
-			remainder = 0;
+		if (mapped && first == 0) {
 
-			first_block = FAT[first_block];
+			failed = hole_send(len, host_fd);
 
-			free(bounce_buffer);
+		} else {
 
-			continue;
+			failed = block_send(superblock.data + first, position % BLOCK_SIZE, len, host_fd);
 
 		}
 
-		if (remainder == 0 && remainder + rest_count < 4096) {
+		if (!failed) {
 
-			//printf("eee\n");
+			sent += len;
 
-			uint8_t *bounce_buffer = (uint8_t *) malloc(4096);
-
-			block_read(superblock.data + first_block, bounce_buffer);
+		}
 
-			memcpy(offset_buf + tmp_buf, bounce_buffer, rest_count);
+		block = next;
 
-			offset_buf = offset_buf + rest_count;
+	}
 
-			rest_count = 0;
+	pthread_rwlock_unlock(&file->lock);
 
-			free(bounce_buffer);
+	fd_put(file);
 
-			break;
+	/* nothing went out */
+	if (failed && sent == 0) {
 
-		}
+		return -1;
 
 	}
 
-	fds[index_in_fds].offset = fds[index_in_fds].offset + offset_buf;
-
-	memcpy(buf, tmp_buf, offset_buf);
-
-	return offset_buf;
-}
\ No newline at end of file
+	return sent;
+}
@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint16_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +11,117 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Initial size of the open file table (it grows past it on demand) */
 #define FS_OPEN_MAX_COUNT 32
 
+/**
+ * Maximum number of data blocks of a file system: the disk holds at most
+ * 0xFFFF blocks, superblock, root directory and 32 FAT blocks included
+ */
+#define FS_DATA_BLOCK_MAX 65501
+
+/** Optional feature: pack small file tails together in shared data blocks */
+#define FS_FEATURE_TAILPACK 0x1
+
+/** Optional feature: share data blocks between files copied with fs_copy() */
+#define FS_FEATURE_REFLINK 0x2
+
+/** Optional feature: files with holes, written past their end of file */
+#define FS_FEATURE_SPARSE 0x4
+
+/** Optional feature: log metadata changes in a journal before writing them in place */
+#define FS_FEATURE_JOURNAL 0x8
+
+/** Optional feature: read-only snapshots of the whole file system */
+#define FS_FEATURE_SNAPSHOT 0x10
+
+/** All optional features known to this implementation */
+#define FS_FEATURE_ALL (FS_FEATURE_TAILPACK | FS_FEATURE_REFLINK | FS_FEATURE_SPARSE | \
+			FS_FEATURE_JOURNAL | FS_FEATURE_SNAPSHOT)
+
+/** Maximum number of snapshots of a file system */
+#define FS_SNAPSHOT_MAX 64
+
+/** Options of fs_format() */
+struct fs_format_options {
+	/* Optional features enabled on the new file system (FS_FEATURE_*) */
+	unsigned int features;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks of the file system
+ * @options: Options of the new file system, NULL for the defaults
+ *
+ * Create virtual disk file @diskname, replacing any existing file, and write
+ * an empty file system with @data_blocks data blocks to it. The disk is made
+ * of the superblock, the smallest FAT covering the data blocks, the root
+ * directory and the data blocks, in this order. The disk file is sparse, and
+ * only the superblock and the first FAT block are written, so formatting
+ * takes the same time whatever the size of the disk.
+ *
+ * The optional features of @options are then enabled as with
+ * fs_set_features(), which allocates their tables in the data blocks.
+ *
+ * Return: -1 if a file system is currently mounted, if @data_blocks is 0 or
+ * larger than %FS_DATA_BLOCK_MAX, if @options contains unknown features, if
+ * the virtual disk file cannot be created or written, or if the features
+ * cannot be enabled. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, const struct fs_format_options *options);
+
+/** fs_check() flag: repair the problems found */
+#define FS_CHECK_REPAIR 0x1
+
+/** Problems found by fs_check() */
+struct fs_check_report {
+	/* Superblock fields inconsistent with each other or with the disk size */
+	size_t geometry_errors;
+	/* Allocated data blocks that nothing points to */
+	size_t leaked_blocks;
+	/* Data blocks pointed to more times than their reference count allows */
+	size_t cross_linked_blocks;
+	/* Data blocks pointed to fewer times than their reference count says */
+	size_t refcount_errors;
+	/* Chains looping back on themselves */
+	size_t cyclic_chains;
+	/* Chains linking to free or out of bounds blocks, invalid packed tails or map entries */
+	size_t broken_chains;
+	/* Files whose size does not match the length of their chain */
+	size_t size_mismatches;
+	/* Problems repaired (FS_CHECK_REPAIR) */
+	size_t repaired;
+};
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file
+ * @flags: %FS_CHECK_REPAIR to repair the problems found, 0 otherwise
+ * @report: Structure to be filled with the problems found
+ *
+ * Check the geometry in the superblock of @diskname, then mount it and walk
+ * the chain and packed tail of every root entry, live or in a snapshot, and
+ * the chains of the metadata tables. Leaked, cross-linked and cyclic chains,
+ * links to free blocks, and sizes not matching the chain length are counted
+ * in @report. The chains are walked by several threads, which mark the blocks
+ * they reach in a shared bitmap, so that blocks shared by several chains are
+ * only counted once; each thread then checks a range of data blocks.
+ *
+ * Mounting replays the journal, if any. Otherwise, nothing is written to the
+ * disk unless @flags has %FS_CHECK_REPAIR: then broken chains are cut and the
+ * size of their file reduced to match, invalid packed tails and map entries
+ * are dropped, leaked blocks are freed, and the reference counts are set to
+ * the number of references found, which makes cross-linked blocks shared
+ * blocks, copied on write.
+ *
+ * Return: -1 if a file system is currently mounted, if @report is NULL, if
+ * @flags is invalid, if @diskname cannot be read or contains no file system,
+ * or if memory cannot be allocated. Otherwise the number of problems found,
+ * 0 if the file system is consistent.
+ */
+int fs_check(const char *diskname, int flags, struct fs_check_report *report);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +130,14 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Once the file system is mounted, the other functions can be called
+ * concurrently from several threads, until fs_umount() is called. Reads of a
+ * file only exclude the writes to the same file, and calls sharing a file
+ * descriptor are serialized on its file offset (except fs_pread() and
+ * fs_pwrite(), which do not use it). Calls that allocate blocks, and calls that
+ * change the directory, are still serialized with one another: only reads, and
+ * writes within already allocated blocks, run in parallel.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -29,13 +147,92 @@ int fs_mount(const char *diskname);
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Modified metadata is written back as with fs_sync().
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * closed, or if there are still open file descriptors, or asynchronous
+ * requests that are running or whose completion was not reaped. 0 otherwise.
  */
 int fs_umount(void);
 
+/** File system counters, as filled by fs_statfs() */
+struct fs_statfs {
+	/* Total amount of blocks of virtual disk */
+	size_t total_blocks;
+	/* Number of blocks for FAT */
+	size_t fat_blocks;
+	/* Root directory block index */
+	size_t root_block;
+	/* Data block start index */
+	size_t data_start;
+	/* Amount of data blocks */
+	size_t data_blocks;
+	/* Amount of free data blocks */
+	size_t free_data_blocks;
+	/* Maximum number of files in the root directory */
+	size_t max_files;
+	/* Amount of free root directory entries */
+	size_t free_files;
+	/* Enabled optional features (FS_FEATURE_*) */
+	unsigned int features;
+	/* Amount of data blocks shared by several files (FS_FEATURE_REFLINK) */
+	size_t shared_data_blocks;
+	/* Amount of data blocks of the metadata journal (FS_FEATURE_JOURNAL) */
+	size_t journal_blocks;
+	/* Number of snapshots (FS_FEATURE_SNAPSHOT) */
+	size_t snapshots;
+};
+
+/** Root directory entry, as filled by fs_readdir() */
+struct fs_dirent {
+	/* Filename (including NULL character) */
+	char name[FS_FILENAME_LEN];
+	/* Size of the file (in bytes) */
+	size_t size;
+	/* Index of the first data block (0xFFFF if the file is empty) */
+	uint16_t first_block;
+	/* Number of data blocks of the file, map blocks included (without a packed tail) */
+	size_t block_count;
+};
+
+/**
+ * fs_sync - Write back file system metadata
+ *
+ * Write the metadata of the currently mounted file system (superblock, FAT
+ * blocks and root directory) that was modified since the last write-back to
+ * the virtual disk. Metadata changes made by fs_create(), fs_delete() and
+ * fs_write() are only kept in memory until fs_sync() or fs_umount() is called.
+ * Only the modified blocks are written, in a single batch sorted by block
+ * index. With %FS_FEATURE_JOURNAL, the changes are logged in the journal
+ * instead, with a single sequential write (see fs_set_features()).
+ *
+ * Return: -1 if no FS is currently mounted, or if writing the metadata, or
+ * the bytes appended through %FS_OPEN_APPEND descriptors, to the virtual disk
+ * fails. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Make a file durable
+ * @fd: File descriptor
+ *
+ * Write back the metadata of the file system as with fs_sync(), then wait
+ * until the data and metadata written so far have reached the storage holding
+ * the virtual disk file. Writes submitted with fs_write_async() are only
+ * covered once they have completed.
+ *
+ * Concurrent calls are committed in groups: while one call writes back and
+ * synchronizes the disk, the calls arriving in the meantime wait, and the next
+ * of them does the work once for all of them. The cost of a call thus stays
+ * about two synchronizations however many threads call it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if writing the bytes
+ * appended to the file, or the metadata, or synchronizing the virtual disk
+ * fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +242,123 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_set_features - Set the optional features of the file system
+ * @features: Bitmask of %FS_FEATURE_* values
+ *
+ * Enable the optional features in @features on the currently mounted file
+ * system and disable the others. The setting is stored in the superblock.
+ *
+ * With %FS_FEATURE_TAILPACK, the partially filled last block of a file is
+ * moved into a data block shared with the tails of other files when the last
+ * file descriptor on the file is closed, if it holds at most half a block.
+ * The tail is addressed by block and offset in the file's root entry, and
+ * moves back to a block of its own the next time the file is written. Such
+ * images cannot be read by implementations unaware of the feature. Disabling
+ * the feature moves every packed tail back to a block of its own, and is only
+ * possible while no file is open.
+ *
+ * With %FS_FEATURE_REFLINK, a table of per-block reference counts is kept in
+ * data blocks, so that files copied with fs_copy() can share their data
+ * blocks. Enabling the feature allocates the table, and disabling it frees the
+ * table, which is only possible while no data block is shared.
+ *
+ * With %FS_FEATURE_SPARSE, a file written past its end of file keeps a map of
+ * its data blocks instead of a chain, in which the blocks of the gap are holes
+ * taking no space on disk. The feature is enabled by the first such write, and
+ * can only be disabled while no file uses a map.
+ *
+ * With %FS_FEATURE_JOURNAL, a journal of up to 32 consecutive data blocks is
+ * allocated, and fs_sync() logs the metadata changed since the previous call
+ * (FAT entries, root entries, reference counts) as a checksummed transaction,
+ * written sequentially after the previous ones. The metadata is written in
+ * place when the journal fills up and on fs_umount(), and mounting replays the
+ * transactions logged since, so that a crash cannot leave the metadata half
+ * written. Enabling the feature needs a run of free consecutive data blocks;
+ * the changes made by fs_set_features() itself are written in place.
+ *
+ * With %FS_FEATURE_SNAPSHOT, a table of the snapshots taken with
+ * fs_snapshot_create() is kept in a data block. The feature is enabled by the
+ * first snapshot, and can only be disabled while no snapshot is left, which
+ * frees the table. %FS_FEATURE_SPARSE cannot be disabled while there are
+ * snapshots.
+ *
+ * A call that fails leaves the enabled features as they were, and changes
+ * nothing on disk but possibly the packed tails moved back to blocks of their
+ * own.
+ *
+ * Return: -1 if no FS is currently mounted, if @features contains unknown
+ * features, if %FS_FEATURE_TAILPACK is disabled while files are open, if
+ * there is not enough free space to unpack the packed tails or to hold the
+ * reference count table, if %FS_FEATURE_REFLINK is disabled
+ * while data blocks are shared, if %FS_FEATURE_SPARSE is disabled while
+ * files use a map or snapshots exist, if %FS_FEATURE_SNAPSHOT is disabled
+ * while snapshots exist, or if there is no room for the journal. 0 otherwise.
+ */
+int fs_set_features(unsigned int features);
+
+/**
+ * fs_statfs - Get file system counters
+ * @st: Structure to be filled with the counters
+ *
+ * Fill @st with the geometry and the free block and free root entry counts of
+ * the currently mounted file system. This is the information displayed by
+ * fs_info(), in machine-readable form.
+ *
+ * Return: -1 if no FS is currently mounted, or if @st is NULL. 0 otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
+/** Usage of a memory pool of the mounted file system, as filled by fs_poolstat() */
+struct fs_poolstat {
+	/* Size of an object of the pool (in bytes) */
+	size_t object_size;
+	/* Number of objects allocated from the heap since mount */
+	size_t allocated;
+	/* Number of objects currently in use */
+	size_t in_use;
+	/* Largest number of objects in use at once since mount */
+	size_t high_water;
+};
+
+/**
+ * fs_poolstat - Get memory pool counters
+ * @buffers: Structure to be filled with the counters of the block buffer pool
+ * @files: Structure to be filled with the counters of the open file pool
+ *
+ * The block-sized staging buffers used by partial block transfers and the
+ * objects describing open files come from pools set up by fs_mount() and
+ * released by fs_umount(). Objects return to the pool after use, so once
+ * @allocated has caught up with @high_water, reads, writes and opens no
+ * longer allocate memory.
+ *
+ * Return: -1 if no FS is currently mounted, or if @buffers or @files is NULL.
+ * 0 otherwise.
+ */
+int fs_poolstat(struct fs_poolstat *buffers, struct fs_poolstat *files);
+
+/** Block I/O of the mounted file system, as filled by fs_iostat() */
+struct fs_iostat {
+	/* Number of blocks read from the virtual disk since mount */
+	size_t block_reads;
+	/* Number of blocks written to the virtual disk since mount */
+	size_t block_writes;
+	/* Number of times the virtual disk was synchronized since mount */
+	size_t syncs;
+};
+
+/**
+ * fs_iostat - Get block I/O counters
+ * @st: Structure to be filled with the counters
+ *
+ * Unlike timings, the counters only depend on the sequence of operations
+ * performed since mount, which makes them suitable to detect changes in the
+ * amount of I/O an operation costs.
+ *
+ * Return: -1 if no FS is currently mounted, or if @st is NULL. 0 otherwise.
+ */
+int fs_iostat(struct fs_iostat *st);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -73,6 +387,109 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_copy - Copy a file without copying its data
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ *
+ * Create file @dst with the size and content of file @src. Both files share
+ * the data blocks of @src, counted in a table of per-block reference counts,
+ * so the copy only costs metadata updates. A shared block is copied the first
+ * time either file writes to it; since a block of a FAT chain has a single
+ * successor, the shared blocks preceding it in the file are copied as well.
+ *
+ * The first copy enables %FS_FEATURE_REFLINK, which allocates the reference
+ * count table in free data blocks. File @src may be open; the copy waits for
+ * the writes to it in progress.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if a file named @dst already exists, or
+ * if the root directory is full, or if there is no room for the reference
+ * count table. 0 otherwise.
+ */
+int fs_copy(const char *src, const char *dst);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ *
+ * Freeze the current content of every file of the currently mounted file
+ * system. The snapshot copies the root directory into a data block and shares
+ * the data blocks of all the files, as fs_copy() does, so it only costs a few
+ * metadata updates; a shared block is copied the first time a file writes to
+ * it. Writes in progress complete before the snapshot is taken, and the ones
+ * issued meanwhile wait for it. The metadata is written back as with fs_sync().
+ *
+ * The first snapshot enables %FS_FEATURE_SNAPSHOT and %FS_FEATURE_REFLINK,
+ * which allocate the snapshot table and the reference count table in free
+ * data blocks.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is a mounted snapshot, or
+ * if there are already %FS_SNAPSHOT_MAX snapshots, or if there is no room for
+ * the root directory copy or the tables, or if writing the metadata fails.
+ * The identifier of the snapshot otherwise.
+ */
+int fs_snapshot_create(void);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @id: Identifier of the snapshot
+ *
+ * Drop the snapshot @id of the currently mounted file system, freeing the
+ * data blocks that no file or other snapshot uses anymore.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is a mounted snapshot, or
+ * if there is no snapshot @id. 0 otherwise.
+ */
+int fs_snapshot_delete(int id);
+
+/**
+ * fs_snapshot_mount - Mount a snapshot of a file system
+ * @diskname: Name of the virtual disk file
+ * @id: Identifier of the snapshot
+ *
+ * Mount the file system of @diskname as it was when snapshot @id was taken,
+ * as with fs_mount(). The snapshot is read-only: the calls that would modify
+ * it (fs_create(), fs_write(), fs_set_features()...) fail, and fs_sync() and
+ * fs_umount() write nothing back.
+ *
+ * Return: -1 if the file system cannot be mounted, or if it has no snapshot
+ * @id. 0 otherwise.
+ */
+int fs_snapshot_mount(const char *diskname, int id);
+
+/**
+ * fs_create_many - Create a batch of new files
+ * @filenames: Array of @count file names
+ * @count: Number of file names in @filenames
+ * @results: Array of @count integers, filled with the outcome of each name
+ *
+ * Create an empty file for every name in @filenames, with the same rules as
+ * fs_create(). All names are validated together (including against each other,
+ * so a name repeated within the batch is only created once) and the root
+ * directory is written to disk once for the whole batch instead of once per
+ * file. @results[i] is set to 0 if @filenames[i] was created, -1 otherwise.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @results is
+ * NULL. Otherwise, return the number of files actually created.
+ */
+int fs_create_many(const char **filenames, size_t count, int *results);
+
+/**
+ * fs_delete_many - Delete a batch of files
+ * @filenames: Array of @count file names
+ * @count: Number of file names in @filenames
+ * @results: Array of @count integers, filled with the outcome of each name
+ *
+ * Delete every file named in @filenames, with the same rules as fs_delete().
+ * The data blocks of the deleted files are released, and the root directory
+ * and the modified FAT blocks are written to disk once for the whole batch.
+ * @results[i] is set to 0 if @filenames[i] was deleted, -1 otherwise.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @results is
+ * NULL. Otherwise, return the number of files actually deleted.
+ */
+int fs_delete_many(const char **filenames, size_t count, int *results);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +499,22 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_readdir - List files on file system
+ * @entries: Array to be filled with directory entries
+ * @max: Number of entries that @entries can hold
+ *
+ * Fill @entries with the name, size, first data block and data block count of
+ * the files located in the root directory, in directory order, without opening
+ * them. Passing an array of %FS_FILE_MAX_COUNT entries lists the whole
+ * directory in one call. This is the information displayed by fs_ls(), in
+ * machine-readable form.
+ *
+ * Return: -1 if no FS is currently mounted, or if @entries is NULL while @max
+ * is not 0. Otherwise, return the number of entries filled.
+ */
+int fs_readdir(struct fs_dirent *entries, size_t max);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -91,24 +524,53 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors, which share the same in-memory state of the file. Descriptors
+ * are allocated lowest first, and the open file table grows past
+ * %FS_OPEN_MAX_COUNT entries when needed.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if the open file table cannot
+ * grow. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
+/** Open flag: every write goes to the end of the file (see fs_open_flags()) */
+#define FS_OPEN_APPEND 0x1
+
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitmask of %FS_OPEN_* values
+ *
+ * Same as fs_open(), with the behavior of the new file descriptor adjusted by
+ * @flags.
+ *
+ * With %FS_OPEN_APPEND, fs_write() and fs_writev() append their data at the
+ * end of the file, whatever the file offset, and leave the file offset at the
+ * end of the file. The last data block of the file is kept in memory, so that
+ * appends take the same time however large the file is: the block is written
+ * to the disk when it fills up, and before anything reads or modifies the file
+ * otherwise, or on fs_sync() and on the last fs_close() of the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * @flags contains unknown flags, or if there is no file named @filename to
+ * open, or if the open file table cannot grow. Otherwise, return the file
+ * descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. The bytes appended to the file and still in
+ * memory (see %FS_OPEN_APPEND) are written to the disk when its last
+ * descriptor is closed.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if the appended bytes
+ * cannot be written, in which case they are lost but @fd is closed anyway. 0
+ * otherwise.
  */
 int fs_close(int fd);
 
@@ -133,9 +595,13 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset can be past the end of the file: a write there extends the file,
+ * and the gap reads back as zeros. Whole blocks of the gap are holes taking
+ * no space on disk (see %FS_FEATURE_SPARSE).
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than INT_MAX. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -154,6 +620,8 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * Likewise, a block that cannot be written to the disk ends the write, and
+ * the file only grows over the bytes written before it.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
@@ -177,9 +645,176 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if a
+ * block of the file cannot be read from the disk. Otherwise return the number
+ * of bytes actually read.
+ */
+int fs_read(int fd, void *buf, size_t count);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write(), with the data gathered from the @iovcnt buffers of @iov
+ * as if they were a single buffer. The file's chain of data blocks is walked
+ * once for the whole call, and a block filled by several buffers is written
+ * once.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if
+ * @iovcnt is negative, or if the buffers add up to more than INT_MAX bytes.
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), with the data scattered over the @iovcnt buffers of @iov
+ * as if they were a single buffer. The file's chain of data blocks is walked
+ * once for the whole call.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if
+ * @iovcnt is negative, or if the buffers add up to more than INT_MAX bytes.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), except that the data is written at offset @offset of the
+ * file, and that the file offset of the file descriptor is neither used nor
+ * modified.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than INT_MAX. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), except that the data is read from offset @offset of the
+ * file, and that the file offset of the file descriptor is neither used nor
+ * modified.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_sendfile - Copy part of a file to a host file descriptor
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to write to, at its current file offset
+ * @offset: File offset to copy from
+ * @count: Number of bytes of data to be copied
+ *
+ * Copy up to @count bytes from offset @offset of the file referenced by @fd to
+ * host file descriptor @host_fd (a host file, pipe, socket...), without going
+ * through a buffer of the caller. Runs of data blocks that follow each other
+ * on disk are copied by the kernel in a single sendfile() call, so memory use
+ * does not depend on @count. The file offset of @fd is neither used nor
+ * modified.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative,
+ * or if reading the disk or writing to @host_fd fails before any byte was
+ * copied. Otherwise return the number of bytes actually copied.
+ */
+int fs_sendfile(int fd, int host_fd, size_t offset, size_t count);
+
+/** Completed asynchronous request, as filled by fs_async_poll() */
+struct fs_completion {
+	/* Tag given when the request was submitted */
+	void *tag;
+	/* Return value of the request, as for fs_pread() or fs_pwrite() */
+	int result;
+};
+
+/**
+ * fs_read_async - Submit an asynchronous read
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ * @tag: Value identifying the request in its completion
+ *
+ * Queue a fs_pread() of @count bytes at offset @offset of the file referenced
+ * by @fd, and return without waiting for it. The request is run by a pool of
+ * worker threads, started by the first submission, and its result is reported
+ * with @tag by fs_async_poll() or fs_async_wait(). @buf must stay valid, and
+ * @fd open, until then.
+ *
+ * Requests run concurrently and complete in any order, so a request depending
+ * on the result of another (e.g. a write extending a file past the offset of
+ * a pending write) must only be submitted once the first one has completed.
+ *
+ * Return: -1 if no FS is currently mounted, or if @buf is NULL, or if the
+ * request cannot be queued. 0 otherwise. Errors of the read itself are
+ * reported in its completion.
+ */
+int fs_read_async(int fd, void *buf, size_t count, size_t offset, void *tag);
+
+/**
+ * fs_write_async - Submit an asynchronous write
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ * @tag: Value identifying the request in its completion
+ *
+ * Same as fs_read_async(), for a fs_pwrite() of @count bytes of @buf at offset
+ * @offset of the file referenced by @fd.
+ *
+ * Return: -1 if no FS is currently mounted, or if @buf is NULL, or if the
+ * request cannot be queued. 0 otherwise.
+ */
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+		   void *tag);
+
+/**
+ * fs_async_poll - Reap completed asynchronous requests
+ * @events: Array to be filled with the completions
+ * @max: Number of entries in @events
+ *
+ * Move up to @max completions, oldest first, to @events without waiting.
+ *
+ * Return: -1 if @events is NULL or @max is smaller than 1. Otherwise return the
+ * number of completions filled in @events (possibly 0).
+ */
+int fs_async_poll(struct fs_completion *events, int max);
+
+/**
+ * fs_async_wait - Wait for completed asynchronous requests
+ * @events: Array to be filled with the completions
+ * @max: Number of entries in @events
+ *
+ * Same as fs_async_poll(), but wait until at least one request has completed
+ * if none has yet and requests are still running.
+ *
+ * Return: -1 if @events is NULL or @max is smaller than 1. Otherwise return the
+ * number of completions filled in @events, which is 0 only if no request is
+ * outstanding.
+ */
+int fs_async_wait(struct fs_completion *events, int max);
 
 #endif /* _FS_H */
@@ -0,0 +1,295 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/* Alignment of the objects, and size of the slab header */
+#define POOL_ALIGN 64
+
+/* Number of pools a thread keeps a private free list for */
+#define POOL_CACHE_SLOTS 8
+
+/* Objects moved at once between a thread free list and the shared one */
+#define POOL_CACHE_BATCH 16
+
+/* Objects a thread keeps before giving a batch back to the shared free list */
+#define POOL_CACHE_MAX (2 * POOL_CACHE_BATCH)
+
+/* Free object, linked through its first bytes */
+struct pool_object {
+	struct pool_object *next;
+};
+
+/* Slab, followed by its objects at offset POOL_ALIGN */
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+struct pool {
+	/* Unique identifier, never reused by a later pool */
+	unsigned long id;
+	/* Next live pool (protected by pool_list_lock) */
+	struct pool *next;
+	/* Size of an object, rounded up to POOL_ALIGN */
+	size_t object_size;
+	/* Number of objects per slab */
+	size_t slab_objects;
+	/* Protects the fields below */
+	pthread_mutex_t lock;
+	/* Shared free list */
+	struct pool_object *free;
+	/* Every slab allocated by the pool */
+	struct pool_slab *slabs;
+	/* Number of objects carved from slabs */
+	size_t allocated;
+	/* Objects handed out, and maximum reached (updated atomically) */
+	size_t in_use;
+	size_t high_water;
+};
+
+/*
+ * Free list private to a thread. The slot of a pool is shared with the pools
+ * whose identifier is congruent to it; the objects left by a previous owner
+ * go back to its shared free list, as do all the objects of a thread when it
+ * exits.
+ */
+struct pool_cache {
+	/* Identifier of the pool the objects belong to */
+	unsigned long id;
+	/* Free objects */
+	struct pool_object *head;
+	/* Number of free objects */
+	size_t count;
+};
+
+static __thread struct pool_cache pool_caches[POOL_CACHE_SLOTS];
+
+/* Whether the free lists of the calling thread are drained at its exit */
+static __thread int pool_caches_registered;
+
+static unsigned long pool_next_id = 1;
+
+/* Live pools, so that a free list can find the pool its objects belong to */
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *pool_list;
+
+/* Key whose destructor drains the free lists of exiting threads */
+static pthread_key_t pool_cache_key;
+static pthread_once_t pool_cache_once = PTHREAD_ONCE_INIT;
+
+/* Give the objects of @cache back to their pool, unless it was destroyed */
+static void pool_cache_drain(struct pool_cache *cache)
+{
+	struct pool_object *object;
+	struct pool *pool;
+
+	if (!cache->head)
+		return;
+
+	pthread_mutex_lock(&pool_list_lock);
+	for (pool = pool_list; pool && pool->id != cache->id; pool = pool->next)
+		;
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+		while (cache->head) {
+			object = cache->head;
+			cache->head = object->next;
+			object->next = pool->free;
+			pool->free = object;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool_list_lock);
+
+	cache->head = NULL;
+	cache->count = 0;
+}
+
+static void pool_cache_exit(void *caches)
+{
+	int i;
+
+	for (i = 0; i < POOL_CACHE_SLOTS; i++)
+		pool_cache_drain((struct pool_cache *)caches + i);
+}
+
+static void pool_cache_key_create(void)
+{
+	pthread_key_create(&pool_cache_key, pool_cache_exit);
+}
+
+/* Free list of the calling thread for @pool */
+static struct pool_cache *pool_cache(struct pool *pool)
+{
+	struct pool_cache *cache = &pool_caches[pool->id % POOL_CACHE_SLOTS];
+
+	if (!pool_caches_registered) {
+		pthread_once(&pool_cache_once, pool_cache_key_create);
+		pthread_setspecific(pool_cache_key, pool_caches);
+		pool_caches_registered = 1;
+	}
+
+	if (cache->id != pool->id) {
+		pool_cache_drain(cache);
+		cache->id = pool->id;
+		cache->head = NULL;
+		cache->count = 0;
+	}
+
+	return cache;
+}
+
+/* Add a slab of objects to the shared free list (pool lock held) */
+static int pool_grow(struct pool *pool)
+{
+	struct pool_slab *slab;
+	char *objects;
+	size_t i;
+
+	if (posix_memalign((void **)&slab, POOL_ALIGN,
+			   POOL_ALIGN + pool->object_size * pool->slab_objects))
+		return -1;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	objects = (char *)slab + POOL_ALIGN;
+	for (i = 0; i < pool->slab_objects; i++) {
+		struct pool_object *object =
+			(struct pool_object *)(objects + i * pool->object_size);
+
+		object->next = pool->free;
+		pool->free = object;
+	}
+	pool->allocated += pool->slab_objects;
+
+	return 0;
+}
+
+struct pool *pool_create(size_t object_size, size_t slab_objects)
+{
+	struct pool *pool;
+
+	if (object_size == 0 || slab_objects == 0)
+		return NULL;
+
+	pool = calloc(1, sizeof(struct pool));
+	if (!pool)
+		return NULL;
+
+	pool->id = __atomic_fetch_add(&pool_next_id, 1, __ATOMIC_RELAXED);
+	pool->object_size = (object_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+	pool->slab_objects = slab_objects;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pthread_mutex_lock(&pool_list_lock);
+	pool->next = pool_list;
+	pool_list = pool;
+	pthread_mutex_unlock(&pool_list_lock);
+
+	return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	struct pool_slab *slab, *next;
+	struct pool **link;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool_list_lock);
+	for (link = &pool_list; *link != pool; link = &(*link)->next)
+		;
+	*link = pool->next;
+	pthread_mutex_unlock(&pool_list_lock);
+
+	/*
+	 * Thread free lists still holding objects of the pool are tagged with
+	 * its id, which is never reused and no longer listed: they are dropped
+	 * on their next use.
+	 */
+	for (slab = pool->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+void *pool_get(struct pool *pool)
+{
+	struct pool_cache *cache = pool_cache(pool);
+	struct pool_object *object;
+	size_t in_use, high_water;
+
+	/* Refill the thread free list with a batch from the shared one */
+	if (!cache->head) {
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->free && pool_grow(pool)) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		while (pool->free && cache->count < POOL_CACHE_BATCH) {
+			object = pool->free;
+			pool->free = object->next;
+			object->next = cache->head;
+			cache->head = object;
+			cache->count++;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	object = cache->head;
+	cache->head = object->next;
+	cache->count--;
+
+	in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+	high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+	while (in_use > high_water &&
+	       !__atomic_compare_exchange_n(&pool->high_water, &high_water, in_use,
+					    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	return object;
+}
+
+void pool_put(struct pool *pool, void *ptr)
+{
+	struct pool_cache *cache = pool_cache(pool);
+	struct pool_object *object = ptr;
+
+	if (!object)
+		return;
+
+	__atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+
+	object->next = cache->head;
+	cache->head = object;
+	cache->count++;
+
+	/* Give a batch back so that other threads can reuse the objects */
+	if (cache->count > POOL_CACHE_MAX) {
+		pthread_mutex_lock(&pool->lock);
+		while (cache->count > POOL_CACHE_MAX - POOL_CACHE_BATCH) {
+			object = cache->head;
+			cache->head = object->next;
+			cache->count--;
+			object->next = pool->free;
+			pool->free = object;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void pool_stat(struct pool *pool, struct pool_stat *st)
+{
+	pthread_mutex_lock(&pool->lock);
+	st->object_size = pool->object_size;
+	st->allocated = pool->allocated;
+	pthread_mutex_unlock(&pool->lock);
+
+	st->in_use = __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+	st->high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Pool of fixed-size objects carved from larger slabs */
+struct pool;
+
+/** Pool counters, as filled by pool_stat() */
+struct pool_stat {
+	/* Size of an object (in bytes) */
+	size_t object_size;
+	/* Number of objects carved from slabs so far */
+	size_t allocated;
+	/* Number of objects currently handed out by pool_get() */
+	size_t in_use;
+	/* Largest value reached by @in_use */
+	size_t high_water;
+};
+
+/**
+ * pool_create - Create a pool of objects
+ * @object_size: Size of the objects (in bytes)
+ * @slab_objects: Number of objects allocated at once when the pool is empty
+ *
+ * Objects are only ever returned to the heap by pool_destroy(), so a pool
+ * serving a steady workload stops allocating once it has reached its high
+ * water mark.
+ *
+ * Return: NULL if the pool cannot be allocated, the new pool otherwise.
+ */
+struct pool *pool_create(size_t object_size, size_t slab_objects);
+
+/**
+ * pool_destroy - Destroy a pool
+ * @pool: Pool to destroy
+ *
+ * Release every slab of @pool to the heap, including the objects that are
+ * still in use or cached by threads.
+ */
+void pool_destroy(struct pool *pool);
+
+/**
+ * pool_get - Take an object from a pool
+ * @pool: Pool to take the object from
+ *
+ * The object is taken from a free list private to the calling thread, which is
+ * refilled in batches from the shared free list of @pool when empty. The
+ * content of the object is undefined.
+ *
+ * Return: NULL if a new slab was needed but could not be allocated, the object
+ * otherwise.
+ */
+void *pool_get(struct pool *pool);
+
+/**
+ * pool_put - Return an object to a pool
+ * @pool: Pool the object was taken from
+ * @object: Object to return
+ *
+ * The object goes to the free list of the calling thread, or to the shared
+ * free list of @pool once the thread has cached enough objects. The objects a
+ * thread still caches when it exits go back to the shared free list.
+ */
+void pool_put(struct pool *pool, void *object);
+
+/**
+ * pool_stat - Get pool counters
+ * @pool: Pool to query
+ * @st: Structure to be filled with the counters
+ */
+void pool_stat(struct pool *pool, struct pool_stat *st);
+
+#endif /* _POOL_H */